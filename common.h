@@ -22,9 +22,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <cinttypes>
 #include <netdb.h>
 #include <unistd.h>
@@ -35,8 +37,24 @@
 #include <unordered_set>
 #include <fstream>
 #include <queue>
+#include <deque>
 #include <chrono>
 #include <iomanip>
+#include <string_view>
+#include <array>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <mutex>
+#include <memory_resource>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 
 // ------------------------- Common functions -------------------------
@@ -45,6 +63,11 @@ int64_t time_ms() {
     return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+// monotonic clock for measuring durations
+int64_t time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 [[noreturn]] void syserr(const char* fmt, ...) {
     va_list fmt_args;
     int org_errno = errno;
@@ -134,6 +157,8 @@ std::string getIPAndPort(const struct sockaddr_storage& address) {
         inet_ntop(address.ss_family, &((struct sockaddr_in6*)&address)->sin6_addr, ipstr, sizeof(ipstr));
         int port = ntohs(((struct sockaddr_in6*)&address)->sin6_port);
         return std::string(ipstr) + ":" + std::to_string(port);
+    } else if (address.ss_family == AF_UNIX) {
+        return "unix:" + std::string(((struct sockaddr_un*)&address)->sun_path); // (empty path for the client side)
     }
     return "<ip-port-unknown>";
 }
@@ -150,6 +175,7 @@ void getSocketAddresses(int socket_fd, std::string& localIpPort, std::string& re
     localIpPort = getIPAndPort(local_address);
 
     // Get remote address
+    address_length = sizeof(struct sockaddr_storage); // (getsockname has shortened it for an unnamed Unix socket)
     if (getpeername(socket_fd, (struct sockaddr*)&remote_address, &address_length) == -1) {
         error("getpeername");
         remoteIpPort = "<ip-port-unknown>";
@@ -298,6 +324,23 @@ std::string seatToString(Seat seat) {
     Reporter::error("Invalid seat");
     return "";
 }
+// index of the seat in the NESW order (0-3), used for compact per-seat arrays
+int seatIndex(Seat seat) {
+    switch (seat) {
+        case Seat::N: return 0;
+        case Seat::E: return 1;
+        case Seat::S: return 2;
+        case Seat::W: return 3;
+    }
+    throw std::invalid_argument("Invalid seat");
+}
+Seat seatFromIndex(int index) {
+    assert(0 <= index && index < 4);
+    return Seat("NESW"[index]);
+}
+bool isSeatChar(char c) {
+    return c == 'N' || c == 'E' || c == 'S' || c == 'W';
+}
 // -----------------------------------------------------------
 
 enum class DealType {
@@ -361,6 +404,16 @@ public:
     }
     bool operator==(const Card& other) const = default;
 
+    static constexpr int DeckSize = 52;
+    // compact index of the card in the deck (0-51, grouped by suit), used for fixed-size deal records and bitmasks
+    [[nodiscard]] uint8_t index() const {
+        return static_cast<uint8_t>(static_cast<int>(suit) * 13 + static_cast<int>(value));
+    }
+    static Card fromIndex(uint8_t index) {
+        assert(index < DeckSize);
+        return {static_cast<CardSuit>(index / 13), static_cast<CardValue>(index % 13)};
+    }
+
     [[nodiscard]] std::string toString() const {
         std::string valueStr;
         switch (value) {
@@ -388,7 +441,7 @@ public:
         return valueStr + suitStr;
     }
     explicit Card(const std::string& cardStr) {
-        std::regex card_regex(R"((10|[23456789JQKA])([CDHS]))");
+        static const std::regex card_regex(R"((10|[23456789JQKA])([CDHS]))");
         std::smatch match;
         if (std::regex_match(cardStr, match, card_regex)) {
             std::string valueStr = match[1].str();
@@ -430,9 +483,57 @@ public:
     }
 };
 
+/* Compact binary encoding of the messages, negotiated with IAM<seat>BIN (for the robots; humans keep the text).
+ * Frame: <length of the rest: 1 byte><type: 1 byte><payload>, cards are Card::index() and seats are seatIndex():
+ *   BUSY          <bitmask of the busy seats>
+ *   DEAL          <deal type><first seat><13 cards>
+ *   TRICK         <trick number><0-3 cards>
+ *   WRONG         <trick number>
+ *   TAKEN         <trick number><4 cards><taker seat>
+ *   SCORE, TOTAL  <4 x uint32 little-endian points, in the NESW order>
+ *   IAM           <seat> (the seat given to an IAM*BIN request)
+ */
+class BinaryFrame {
+public:
+    enum class Type : uint8_t { Busy = 1, Deal, Trick, Wrong, Taken, Score, Total, IAm };
+
+    static std::string make(Type type, const std::string& payload) {
+        assert(payload.size() < 255);
+        std::string frame;
+        frame.reserve(2 + payload.size());
+        frame += static_cast<char>(payload.size() + 1);
+        frame += static_cast<char>(type);
+        frame += payload;
+        return frame;
+    }
+
+    // size of the frame starting at 'start' (it must be there)
+    static size_t sizeAt(const std::string& data, size_t start) {
+        return 1 + static_cast<uint8_t>(data[start]);
+    }
+
+    [[nodiscard]] static bool hasFrame(const std::string& data) {
+        return !data.empty() && data.size() >= sizeAt(data, 0);
+    }
+
+    static void appendPoints(std::string& payload, const std::unordered_map<Seat, int>& points) {
+        for (int seat = 0; seat < 4; ++seat) {
+            auto it = points.find(seatFromIndex(seat));
+            auto value = static_cast<uint32_t>(it == points.end() ? 0 : it->second);
+            for (int byte = 0; byte < 4; ++byte) {
+                payload += static_cast<char>(value >> (8 * byte) & 0xff);
+            }
+        }
+    }
+};
+
 class Msg {
 public:
     [[nodiscard]] virtual std::string toString() const = 0;
+    // (only the messages sent by the server, see BinaryFrame)
+    [[nodiscard]] virtual std::string toBinary() const {
+        throw std::logic_error("The message has no binary encoding.");
+    }
     explicit operator std::string() const {
         return toString();
     }
@@ -441,12 +542,31 @@ public:
     }
 };
 
+// IAM<seat> asks for the seat, IAM* for any free one (the server answers with IAM<seat> when it seats the client).
 class IAm : public Msg {
 public:
     Seat seat;
-    explicit IAm(Seat seat) : seat(seat) {}
+    bool binary; // the client wants the binary encoding from now on (see BinaryFrame)
+    bool anySeat = false; // (the seat is meaningless then)
+    explicit IAm(Seat seat, bool binary = false) : seat(seat), binary(binary) {}
+    static IAm any(bool binary = false) {
+        IAm iam(Seat::N, binary);
+        iam.anySeat = true;
+        return iam;
+    }
     [[nodiscard]] std::string toString() const override {
-        return "IAM" + ::seatToString(seat) + "\r\n";
+        return "IAM" + (anySeat ? "*" : ::seatToString(seat)) + (binary ? "BIN" : "") + "\r\n";
+    }
+    // (only the answer of the server)
+    [[nodiscard]] std::string toBinary() const override {
+        return BinaryFrame::make(BinaryFrame::Type::IAm, std::string(1, static_cast<char>(seatIndex(seat))));
+    }
+};
+// Sent instead of IAM by a read-only observer of the table (it gets DEAL without the hand, TAKEN, SCORE and TOTAL).
+class Watch : public Msg {
+public:
+    [[nodiscard]] std::string toString() const override {
+        return "WATCH\r\n";
     }
 };
 /*
@@ -505,6 +625,13 @@ public:
         result += "\r\n";
         return result;
     }
+    [[nodiscard]] std::string toBinary() const override {
+        uint8_t mask = 0;
+        for (const auto& seat: busy_seats) {
+            mask |= 1 << seatIndex(seat);
+        }
+        return BinaryFrame::make(BinaryFrame::Type::Busy, std::string(1, static_cast<char>(mask)));
+    }
 
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
@@ -530,6 +657,14 @@ public:
         return result;
     }
 
+    [[nodiscard]] std::string toBinary() const override {
+        std::string payload{static_cast<char>(dealType), static_cast<char>(seatIndex(firstSeat))};
+        for (const auto& card: cards) {
+            payload += static_cast<char>(card.index());
+        }
+        return BinaryFrame::make(BinaryFrame::Type::Deal, payload);
+    }
+
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
         result += "New deal " + std::to_string(static_cast<int>(dealType)) + ": staring place " +
@@ -558,6 +693,14 @@ public:
         return result;
     }
 
+    [[nodiscard]] std::string toBinary() const override {
+        std::string payload(1, static_cast<char>(trickNumber));
+        for (const auto& card: cards) {
+            payload += static_cast<char>(card.index());
+        }
+        return BinaryFrame::make(BinaryFrame::Type::Trick, payload);
+    }
+
     // CAUTION! The message 'Available: <lista kart, które gracz jeszcze ma na ręce>' should be printed by the caller!
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
@@ -577,6 +720,9 @@ public:
     [[nodiscard]] std::string toString() const override {
         return "WRONG" + std::to_string(trickNumber) + "\r\n";
     }
+    [[nodiscard]] std::string toBinary() const override {
+        return BinaryFrame::make(BinaryFrame::Type::Wrong, std::string(1, static_cast<char>(trickNumber)));
+    }
 
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
@@ -601,6 +747,14 @@ public:
         result += ::seatToString(takerSeat) + "\r\n";
         return result;
     }
+    [[nodiscard]] std::string toBinary() const override {
+        std::string payload(1, static_cast<char>(trickNumber));
+        for (const auto& card: cardsOnTable) {
+            payload += static_cast<char>(card.index());
+        }
+        payload += static_cast<char>(seatIndex(takerSeat));
+        return BinaryFrame::make(BinaryFrame::Type::Taken, payload);
+    }
 
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
@@ -623,6 +777,11 @@ public:
         result += "\r\n";
         return result;
     }
+    [[nodiscard]] std::string toBinary() const override {
+        std::string payload;
+        BinaryFrame::appendPoints(payload, scores);
+        return BinaryFrame::make(BinaryFrame::Type::Score, payload);
+    }
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
         result += "The scores are:\n";
@@ -645,6 +804,11 @@ public:
         result += "\r\n";
         return result;
     }
+    [[nodiscard]] std::string toBinary() const override {
+        std::string payload;
+        BinaryFrame::appendPoints(payload, total_scores);
+        return BinaryFrame::make(BinaryFrame::Type::Total, payload);
+    }
     [[nodiscard]] std::string toStringVerbose() const override {
         std::string result/*  = this->toString() */;
         result += "The total scores are:\n";
@@ -655,38 +819,376 @@ public:
     }
 };
 
+// A message (or a batch of messages) serialized once in both encodings, sent in the one each receiver uses.
+struct WireMessage {
+    std::string text, binary;
+
+    WireMessage() = default;
+    explicit WireMessage(const Msg& message) : text(message.toString()), binary(message.toBinary()) {}
+
+    WireMessage& operator+=(const WireMessage& other) {
+        text += other.text;
+        binary += other.binary;
+        return *this;
+    }
+    void clear() {
+        text.clear();
+        binary.clear();
+    }
+    [[nodiscard]] const std::string& encoded(bool binaryEncoding) const {
+        return binaryEncoding ? binary : text;
+    }
+};
+
+// Counters kept per thread and summed on read: each thread bumps only its own shard (relaxed atomics, so no locked
+// instructions and no shared cache lines on the hot path), a reader (e.g. a metrics scrape) adds all the shards up.
+// 'Tag' only tells the counter sets apart; shards of exited threads stay, so their counts aren't lost.
+template<class Tag, size_t N>
+class ShardedCounters {
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, N> values{};
+    };
+    static inline std::mutex mutex; // guards only the list of the shards
+    static inline std::vector<std::unique_ptr<Shard>> shards;
+
+    static Shard& _local() {
+        thread_local Shard* shard = [] {
+            std::lock_guard lock(mutex);
+            shards.push_back(std::make_unique<Shard>());
+            return shards.back().get();
+        }();
+        return *shard;
+    }
+public:
+    static void add(size_t counter, uint64_t n = 1) {
+        auto& value = _local().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    [[nodiscard]] static uint64_t sum(size_t counter) {
+        std::lock_guard lock(mutex);
+        uint64_t total = 0;
+        for (auto& shard : shards) total += shard->values[counter].load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+// Messages received and sent through the PollBuffers, by direction and type.
+struct MessageCounters : ShardedCounters<MessageCounters, 2 * 10> {
+    enum Type { IAm, Watch, Busy, Deal, Trick, Wrong, Taken, Score, Total, Other, Types };
+    static constexpr std::array<const char*, Types> names =
+            {"IAM", "WATCH", "BUSY", "DEAL", "TRICK", "WRONG", "TAKEN", "SCORE", "TOTAL", "other"};
+
+    // (only looks at the first bytes, the message doesn't have to be valid)
+    static Type typeOf(const std::string& message) {
+        if (message.size() < 2) return Other;
+        if (static_cast<unsigned char>(message[0]) < ' ') { // a binary frame (see BinaryFrame)
+            auto type = static_cast<uint8_t>(message[1]);
+            if (type == static_cast<uint8_t>(BinaryFrame::Type::IAm)) return IAm;
+            return type >= 1 && type <= 7 ? static_cast<Type>(Busy + type - 1) : Other;
+        }
+        switch (message[0]) {
+            case 'I': return IAm;
+            case 'B': return Busy;
+            case 'D': return Deal;
+            case 'S': return Score;
+            case 'W': return message[1] == 'A' ? Watch : message[1] == 'R' ? Wrong : Other;
+            case 'T': return message[1] == 'R' ? Trick : message[1] == 'A' ? Taken : message[1] == 'O' ? Total : Other;
+            default: return Other;
+        }
+    }
+    static void count(bool incoming, const std::string& message) {
+        add(index(incoming, typeOf(message)));
+    }
+    static size_t index(bool incoming, Type type) {
+        return (incoming ? 0 : Types) + type;
+    }
+};
+
+// Optional timeline of the program: duration and instant events with monotonic timestamps, recorded into a buffer
+// per thread (no locking while recording) and appended to a file in the Chrome trace-event JSON format, which opens
+// in chrome://tracing and in ui.perfetto.dev. The closing ']' is left out, as the format allows, so the file stays
+// valid after every flush (and after an exit). The file is appended to, each flush with a single write, so a server
+// taking over after a handoff (see -H) adds its events (with its own pid) next to the exiting one's. Recording costs
+// one relaxed load while disabled.
+class Tracer {
+    struct Event {
+        const char* name; // (a literal)
+        char phase; // 'X' = complete (with a duration), 'i' = instant
+        int64_t start_us, duration_us;
+        std::string args; // JSON object or empty
+    };
+    struct Buffer {
+        int tid;
+        std::vector<Event> events;
+    };
+    static constexpr size_t FlushThreshold = 1 << 16; // events per thread
+
+    static inline std::atomic<bool> enabled{false};
+    static inline std::mutex mutex; // guards the file and the list of the buffers
+    static inline std::vector<std::unique_ptr<Buffer>> buffers;
+    static inline int fd = -1;
+
+    static Buffer& _local() {
+        thread_local Buffer* buffer = [] {
+            std::lock_guard lock(mutex);
+            buffers.push_back(std::make_unique<Buffer>(Buffer{static_cast<int>(gettid()), {}}));
+            return buffers.back().get();
+        }();
+        return *buffer;
+    }
+    // (O_APPEND: one write lands whole at the end of the file, whoever else appends to it)
+    static void _write(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = write(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                syserr("write to the trace file");
+            }
+            data.remove_prefix(written);
+        }
+    }
+    static void _record(Event event) {
+        auto& buffer = _local();
+        buffer.events.push_back(std::move(event));
+        if (buffer.events.size() >= FlushThreshold) flush();
+    }
+
+public:
+    static void enable(const std::string& filename) {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            syserr("cannot open the trace file %s", filename.c_str());
+        }
+        if (st.st_size == 0) {
+            _write("[\n");
+        }
+        enabled = true;
+        std::atexit(flush);
+    }
+    [[nodiscard]] static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void instant(const char* name, std::string args = {}) {
+        if (!isEnabled()) return;
+        _record({name, 'i', time_us(), 0, std::move(args)});
+    }
+
+    // Records the duration of its lifetime.
+    class Scope {
+        const char* name;
+        int64_t start_us;
+    public:
+        std::string args;
+        explicit Scope(const char* name, std::string args = {}) : name(name), start_us(isEnabled() ? time_us() : 0), args(std::move(args)) {}
+        ~Scope() {
+            if (start_us != 0) _record({name, 'X', start_us, time_us() - start_us, std::move(args)});
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // {"key":"value"} with the value escaped for JSON
+    static std::string arg(const char* key, std::string_view value) {
+        std::string result = std::string("{\"") + key + "\":\"";
+        for (char c: value) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if (static_cast<unsigned char>(c) < ' ') {
+                char escaped[8];
+                snprintf(escaped, sizeof escaped, "\\u%04x", static_cast<unsigned char>(c));
+                result += escaped;
+            } else {
+                result += c;
+            }
+        }
+        return result + "\"}";
+    }
+
+    // Appends the recorded events of all the threads to the file.
+    static void flush() {
+        if (!isEnabled()) return;
+        std::lock_guard lock(mutex);
+        int pid = getpid();
+        std::string out;
+        for (auto& buffer: buffers) {
+            for (const auto& event: buffer->events) {
+                char line[160];
+                snprintf(line, sizeof line, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d", event.name, event.phase,
+                         event.start_us, pid, buffer->tid);
+                out += line;
+                if (event.phase == 'X') out += ",\"dur\":" + std::to_string(event.duration_us);
+                if (event.phase == 'i') out += ",\"s\":\"t\"";
+                if (!event.args.empty()) out += ",\"args\":" + event.args;
+                out += "},\n";
+            }
+            buffer->events.clear();
+        }
+        _write(out);
+    }
+};
+
 class Parser {
 public:
-    static std::vector<Card> parseCards(std::string cardsStr) {
+    // Regex-free parsing of a single card (e.g. "10H") starting at 'it'.
+    // On success 'it' is moved past the card, otherwise it's left unchanged and nullopt is returned.
+    static std::optional<Card> parseCard(const char*& it, const char* end) {
+        const char* p = it;
+        if (p == end) return std::nullopt;
+        CardValue value;
+        switch (*p) {
+            case '2': value = CardValue::Two; break;
+            case '3': value = CardValue::Three; break;
+            case '4': value = CardValue::Four; break;
+            case '5': value = CardValue::Five; break;
+            case '6': value = CardValue::Six; break;
+            case '7': value = CardValue::Seven; break;
+            case '8': value = CardValue::Eight; break;
+            case '9': value = CardValue::Nine; break;
+            case '1':
+                if (p + 1 == end || p[1] != '0') return std::nullopt;
+                value = CardValue::Ten; ++p; break;
+            case 'J': value = CardValue::Jack; break;
+            case 'Q': value = CardValue::Queen; break;
+            case 'K': value = CardValue::King; break;
+            case 'A': value = CardValue::Ace; break;
+            default: return std::nullopt;
+        }
+        if (++p == end) return std::nullopt;
+        CardSuit suit;
+        switch (*p) {
+            case 'C': suit = CardSuit::Clubs; break;
+            case 'D': suit = CardSuit::Diamonds; break;
+            case 'H': suit = CardSuit::Hearts; break;
+            case 'S': suit = CardSuit::Spades; break;
+            default: return std::nullopt;
+        }
+        it = p + 1;
+        return Card(suit, value);
+    }
+    // (the cards are already validated by the message regex)
+    static std::vector<Card> parseCards(const std::string& cardsStr) {
         std::vector<Card> cards;
-        std::regex card_regex(R"(((10|[23456789JQKA])([CDHS])))");
-        std::sregex_iterator it(cardsStr.begin(), cardsStr.end(), card_regex);
-        std::sregex_iterator end;
+        cards.reserve(cardsStr.size() / 2);
+        const char* it = cardsStr.data();
+        const char* end = it + cardsStr.size();
         while (it != end) {
-            std::smatch card_match = *it;
-            std::string cardStr = card_match.str();
-            cards.push_back(Card(cardStr));
-            ++it;
+            auto card = parseCard(it, end);
+            if (!card) throw std::invalid_argument("Invalid cards: " + cardsStr);
+            cards.push_back(*card);
         }
         return cards;
     }
-    static std::shared_ptr<Msg> parse(std::string message) {
+    // Parses one whole binary frame (see BinaryFrame), returns nullptr if it's invalid.
+    static std::shared_ptr<Msg> parseBinary(const std::string& frame) {
+        if (frame.size() < 2 || BinaryFrame::sizeAt(frame, 0) != frame.size()) {
+            return nullptr;
+        }
+        const auto* payload = reinterpret_cast<const uint8_t*>(frame.data()) + 2;
+        size_t size = frame.size() - 2;
+        auto isTrickNumber = [](uint8_t n) { return n >= Trick::FirstTrickNumber && n <= Trick::LastTrickNumber; };
+        // cards from payload[from, to), nullopt if any of them is invalid or repeated
+        auto cardsAt = [payload](size_t from, size_t to) -> std::optional<std::vector<Card>> {
+            std::vector<Card> cards;
+            uint64_t seen = 0;
+            for (size_t i = from; i < to; ++i) {
+                if (payload[i] >= Card::DeckSize || (seen >> payload[i] & 1)) return std::nullopt;
+                seen |= uint64_t{1} << payload[i];
+                cards.push_back(Card::fromIndex(payload[i]));
+            }
+            return cards;
+        };
+        auto pointsAt = [payload]() {
+            std::unordered_map<Seat, int> points;
+            for (int seat = 0; seat < 4; ++seat) {
+                uint32_t value = 0;
+                for (int byte = 0; byte < 4; ++byte) {
+                    value |= uint32_t{payload[seat * 4 + byte]} << (8 * byte);
+                }
+                points[seatFromIndex(seat)] = static_cast<int>(value);
+            }
+            return points;
+        };
+
+        switch (static_cast<BinaryFrame::Type>(static_cast<uint8_t>(frame[1]))) {
+            case BinaryFrame::Type::Busy: {
+                if (size != 1 || payload[0] == 0 || payload[0] > 15) return nullptr;
+                std::vector<Seat> busySeats;
+                for (int seat = 0; seat < 4; ++seat) {
+                    if (payload[0] >> seat & 1) busySeats.push_back(seatFromIndex(seat));
+                }
+                return std::make_shared<Busy>(busySeats);
+            }
+            case BinaryFrame::Type::Deal: {
+                if (size != 2 + 13 || payload[0] < static_cast<int>(DealType::NoTricks) ||
+                    payload[0] > static_cast<int>(DealType::Robber) || payload[1] >= 4) return nullptr;
+                auto cards = cardsAt(2, size);
+                if (!cards) return nullptr;
+                return std::make_shared<Deal>(static_cast<DealType>(payload[0]), seatFromIndex(payload[1]), *cards);
+            }
+            case BinaryFrame::Type::Trick: {
+                if (size < 1 || size > 4 || !isTrickNumber(payload[0])) return nullptr;
+                auto cards = cardsAt(1, size);
+                if (!cards) return nullptr;
+                return std::make_shared<Trick>(payload[0], *cards);
+            }
+            case BinaryFrame::Type::Wrong:
+                if (size != 1 || !isTrickNumber(payload[0])) return nullptr;
+                return std::make_shared<Wrong>(payload[0]);
+            case BinaryFrame::Type::Taken: {
+                if (size != 6 || !isTrickNumber(payload[0]) || payload[5] >= 4) return nullptr;
+                auto cards = cardsAt(1, 5);
+                if (!cards) return nullptr;
+                return std::make_shared<Taken>(payload[0], *cards, seatFromIndex(payload[5]));
+            }
+            case BinaryFrame::Type::Score:
+                if (size != 16) return nullptr;
+                return std::make_shared<Score>(pointsAt());
+            case BinaryFrame::Type::Total:
+                if (size != 16) return nullptr;
+                return std::make_shared<Total>(pointsAt());
+            case BinaryFrame::Type::IAm:
+                if (size != 1 || payload[0] >= 4) return nullptr;
+                return std::make_shared<IAm>(seatFromIndex(payload[0]));
+        }
+        return nullptr;
+    }
+
+    // (the encoding is the one negotiated by the connection, never guessed from the message)
+    static std::shared_ptr<Msg> parse(std::string message, bool binary = false) {
         std::smatch match;
 
+        if (binary) {
+            return parseBinary(message);
+        }
+        // a text message has no control bytes but its "\r\n" (so a binary frame is never taken for one)
+        if (message.size() < 2 || std::any_of(message.begin(), message.end() - 2, [](char c) { return static_cast<uint8_t>(c) < ' '; })) {
+            return nullptr;
+        }
+
+        if (message == "WATCH\r\n") {
+            return std::make_shared<Watch>();
+        }
+
         try {
-            const std::string card_non_capturing_regex = "(?:(?:10|[23456789JQKA])[CDHS])";
-            std::regex IAM_regex(R"(^IAM([NESW])\r\n$)");
-            std::regex BUSY_regex(R"(^BUSY([NESW]+)\r\n$)");
-            std::regex DEAL_regex(R"(^DEAL([1-7])([NESW])(((10|[23456789JQKA])[CDHS]){13})\r\n$)");
-            std::regex TRICK_regex(R"(^TRICK([1-9]|1[0-3])(((10|[23456789JQKA])[CDHS]){0,3})\r\n$)");
-            std::regex WRONG_regex(R"(^WRONG([1-9]|1[0-3])\r\n$)");
-            std::regex TAKEN_regex(R"(^TAKEN([1-9]|1[0-3])((?:(?:10|[23456789JQKA])[CDHS]){4})([NESW])\r\n$)");
-            std::regex SCORE_regex(R"(^SCORE([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)\r\n$)");
-            std::regex TOTAL_regex(R"(^TOTAL([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)\r\n$)");
+            // compiled once (building a std::regex costs thousands of allocations)
+            static const std::regex IAM_regex(R"(^IAM([NESW*])(BIN)?\r\n$)");
+            static const std::regex BUSY_regex(R"(^BUSY([NESW]+)\r\n$)");
+            static const std::regex DEAL_regex(R"(^DEAL([1-7])([NESW])(((10|[23456789JQKA])[CDHS]){13})\r\n$)");
+            static const std::regex TRICK_regex(R"(^TRICK([1-9]|1[0-3])(((10|[23456789JQKA])[CDHS]){0,3})\r\n$)");
+            static const std::regex WRONG_regex(R"(^WRONG([1-9]|1[0-3])\r\n$)");
+            static const std::regex TAKEN_regex(R"(^TAKEN([1-9]|1[0-3])((?:(?:10|[23456789JQKA])[CDHS]){4})([NESW])\r\n$)");
+            static const std::regex SCORE_regex(R"(^SCORE([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)\r\n$)");
+            static const std::regex TOTAL_regex(R"(^TOTAL([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)([NESW])(\d+)\r\n$)");
 
             if (std::regex_match(message, match, IAM_regex)) {
+                if (match[1].str()[0] == '*') {
+                    return std::make_shared<IAm>(IAm::any(match[2].matched));
+                }
                 Seat seat = Seat(match[1].str()[0]);
-                return std::make_shared<IAm>(seat);
+                return std::make_shared<IAm>(seat, match[2].matched);
             } else if (std::regex_match(message, match, BUSY_regex)) {
                 std::string seatsStr = match[1].str();
                 std::vector<Seat> busySeats;
@@ -760,13 +1262,30 @@ private:
     std::string buffer_in, buffer_out; // maybe not both used
     struct pollfd* pollfd;
     bool error = false;
+    bool binary = false; // binary frames instead of the separated text messages (see BinaryFrame)
+    bool counted = true; // the messages go into MessageCounters
+
+    // output backpressure: the buffer is 'congested' from exceeding the high watermark until it drains below the low one
+    size_t high_watermark = SIZE_MAX, low_watermark = 0;
+    bool congested = false;
+    size_t peak_queued = 0;
+
+    void updateCongestion() {
+        peak_queued = std::max(peak_queued, buffer_out.size());
+        if (buffer_out.size() > high_watermark) {
+            congested = true;
+        } else if (buffer_out.size() <= low_watermark) {
+            congested = false;
+        }
+    }
 
     bool updateErrors() {
         if (pollfd->revents & POLLERR) {
             error = true;
             return true;
         }
-        if (pollfd->revents & POLLHUP) {
+        // (a Unix domain socket reports POLLHUP as soon as the peer closes it, so the data still queued is read first)
+        if ((pollfd->revents & POLLHUP) && !(pollfd->revents & POLLIN)) {
             Reporter::debug(Color::Red, "POLLHUP detected.");
             error = true;
             return true;
@@ -792,7 +1311,7 @@ private:
                 return;
             }
 
-            buffer_in += std::string(buffer, size);
+            buffer_in.append(buffer, size);
         }
     }
     void updatePollOut() {
@@ -813,6 +1332,7 @@ private:
             }
 
             buffer_out.erase(0, size);
+            updateCongestion();
             if (buffer_out.empty()) {
                 // remove the POLLOUT flag
                 pollfd->events &= ~POLLOUT;
@@ -837,6 +1357,8 @@ public:
         // clear the buffers
         buffer_in.clear();
         buffer_out.clear();
+        congested = false;
+        binary = false;
 
         if (pollfd != nullptr) {
             // close the socket
@@ -851,11 +1373,34 @@ public:
             pollfd = nullptr; // drop the pointer
         }
     }
+    // Detaches the socket from the buffer and its pollfd slot without closing it (e.g. to serve it elsewhere).
+    // The unread input and unsent output are dropped.
+    int release() {
+        assert(isConnected());
+        int fd = pollfd->fd;
+        buffer_in.clear();
+        buffer_out.clear();
+        congested = false;
+        binary = false;
+        pollfd->fd = -1;
+        pollfd->events = 0;
+        pollfd->revents = 0;
+        pollfd = nullptr;
+        return fd;
+    }
     // function called when settings the PollBuffer object for a new client that has just connected (and it's descriptor is in the fds array)
-    void connect(struct pollfd* _pollfd) {
+    // (a recycled buffer keeps the memory of its strings)
+    void connect(struct pollfd* _pollfd, bool enable_reporting = true, std::string msg_separator = "\r\n") {
         // clear the buffers
         buffer_in.clear();
         buffer_out.clear();
+        congested = false;
+        binary = false;
+        counted = true;
+        error = false;
+        peak_queued = 0;
+        reporting_enabled = enable_reporting;
+        buffer_in_msg_separator = std::move(msg_separator);
 
         // set the pollfd structure
         this->pollfd = _pollfd;
@@ -884,9 +1429,26 @@ public:
     [[nodiscard]] bool hasError() const {
         return error;
     }
+    // anything received and not read yet (even an incomplete message)
+    [[nodiscard]] bool hasInput() const {
+        return !buffer_in.empty();
+    }
     [[nodiscard]] bool hasMessage() const {
+        if (binary) return BinaryFrame::hasFrame(buffer_in);
         return buffer_in.find(buffer_in_msg_separator) != std::string::npos;
     }
+
+    // Switches the framing of the input and the encoding of the Msg and WireMessage output (after IAM<seat>BIN).
+    void setBinary(bool enable) {
+        binary = enable;
+    }
+    [[nodiscard]] bool isBinary() const {
+        return binary;
+    }
+    // e.g. for the connections that don't speak the game protocol (metrics scrapes)
+    void setCounted(bool enable) {
+        counted = enable;
+    }
     // ------------------------------->---------------------------->---------------------------------->
     // N E S W | TRICK -> N | wait (no msg) | safePoll (S disconnected) | safePoll ... |  safePoll ... | safePoll (S connected) | DEAL -> S
     //                                                                    N -> TRICK   |
@@ -896,15 +1458,17 @@ public:
     //
     std::string readMessage() {
         assert(hasMessage());
-        // return the message including the separator and remove it from the buffer
-        auto pos = buffer_in.find(buffer_in_msg_separator);
-        std::string message = buffer_in.substr(0, pos + buffer_in_msg_separator.size());
-        buffer_in.erase(0, pos + buffer_in_msg_separator.size());
+        // return the message including the separator (or the whole frame) and remove it from the buffer
+        size_t size = binary ? BinaryFrame::sizeAt(buffer_in, 0)
+                             : buffer_in.find(buffer_in_msg_separator) + buffer_in_msg_separator.size();
+        std::string message = buffer_in.substr(0, size);
+        buffer_in.erase(0, size);
+        _account(true, message);
 
         if (reporting_enabled) {
             std::string localIpPort, remoteIpPort;
             getSocketAddresses(pollfd->fd, localIpPort,remoteIpPort);
-            Reporter::report(remoteIpPort, localIpPort, getCurrentTime(), message);
+            Reporter::report(remoteIpPort, localIpPort, getCurrentTime(), _printable(message));
         }
 
         return message;
@@ -917,66 +1481,168 @@ public:
     void writeMessage(const std::string& message) {
         assert(!message.empty());
         buffer_out += message;
-        pollfd->events |= POLLOUT; // add the POLLOUT flag
+        _trySendNow();
+        updateCongestion();
+        _account(false, message);
 
         if (reporting_enabled) {
             std::string localIpPort, remoteIpPort;
             getSocketAddresses(pollfd->fd, localIpPort,remoteIpPort);
-            Reporter::report(localIpPort, remoteIpPort, getCurrentTime(), message);
+            Reporter::report(localIpPort, remoteIpPort, getCurrentTime(), _printable(message));
         }
     }
 
-    void writeMessage(const Msg& message) {
-        writeMessage(message.toString());
+    // counts (and traces) a message of the game protocol
+    void _account(bool incoming, const std::string& message) const {
+        if (!counted) return;
+        MessageCounters::count(incoming, message);
+        if (Tracer::isEnabled()) {
+            Tracer::instant(incoming ? "recv" : "send", Tracer::arg("message", _printable(message)));
+        }
     }
 
-    [[nodiscard]] bool isConnected() const {
-        return pollfd != nullptr && pollfd->fd != -1;
+    // the binary frames are reported in their text form
+    [[nodiscard]] std::string _printable(const std::string& message) const {
+        if (!binary) return message;
+        auto msg = Parser::parse(message, true);
+        return msg ? msg->toString() : "<invalid binary frame>\r\n";
     }
 
-    int _flushWrite() {
-        while (!buffer_out.empty()) {
-            ssize_t size = write(pollfd->fd, buffer_out.c_str(), buffer_out.size());
-            if (size < 0) {
-                Reporter::debug(Color::Red, "Flushing write buffer failed.");
-                return -1;
-            }
-            if (size == 0) {
-                Reporter::debug(Color::Blue, "Flushing write buffer stopped - connection closed with EOF.");
-                return 0;
+    // Writes a batch of messages (each one ending with "\r\n", or whole binary frames) with a single send attempt;
+    // the messages are still reported one by one, but with one address lookup and one timestamp.
+    void writeMessages(const std::string& messages) {
+        assert(!messages.empty());
+        buffer_out += messages;
+        _trySendNow();
+        updateCongestion();
+
+        if (!reporting_enabled && !counted) return;
+        std::string localIpPort, remoteIpPort, time;
+        if (reporting_enabled) {
+            time = getCurrentTime();
+            getSocketAddresses(pollfd->fd, localIpPort,remoteIpPort);
+        }
+        for (size_t start = 0, end; start < messages.size(); start = end) {
+            if (binary) {
+                end = std::min(messages.size(), start + BinaryFrame::sizeAt(messages, start));
+            } else {
+                end = messages.find("\r\n", start);
+                end = end == std::string::npos ? messages.size() : end + 2;
             }
+            std::string message = messages.substr(start, end - start);
+            _account(false, message);
+            if (reporting_enabled) Reporter::report(localIpPort, remoteIpPort, time, _printable(message));
+        }
+    }
+
+    // Optimistic write-through: if nothing else is queued, try to send the buffer right away (without blocking),
+    // saving a poll round-trip. Only the leftover (if any) waits for POLLOUT; errors are left for the next poll to detect.
+    void _trySendNow() {
+        if (pollfd->events & POLLOUT) {
+            return; // older data is already waiting for POLLOUT, keep the order
+        }
+        ssize_t size = send(pollfd->fd, buffer_out.data(), buffer_out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (size > 0) {
             buffer_out.erase(0, size);
         }
-        return 0;
+        if (!buffer_out.empty()) {
+            pollfd->events |= POLLOUT; // add the POLLOUT flag
+        }
     }
-    // Danger: this function is *blocking* to flush the whole output buffer!
-    // It writes directly to the socket and waits until the whole buffer is written.
-    void flush(int timeout_s) {
-        // Change the socket to blocking mode.
-        // This is necessary to ensure that the whole buffer is written.
-        int flags = fcntl(pollfd->fd, F_GETFL, 0);
-        fcntl(pollfd->fd, F_SETFL, flags & ~O_NONBLOCK);
 
-        // temporarily set timeout to the socket to avoid blocking forever
-        timeval tv = { timeout_s, 0 } ;
-        setsockopt(pollfd->fd, SOL_SOCKET, SO_SNDTIMEO, (const void*)&tv, sizeof tv);
+    // preallocates the input and output buffers (e.g. for a pooled connection)
+    void reserve(size_t bytes) {
+        buffer_in.reserve(bytes);
+        buffer_out.reserve(bytes);
+    }
 
-        _flushWrite();
+    // the input that has already been read from the socket elsewhere (e.g. while it was parked), read before the rest
+    void preload(std::string_view input) {
+        buffer_in.insert(0, input);
+    }
+    // what has been received and not read yet (e.g. to pass it on with the socket)
+    [[nodiscard]] std::string_view input() const {
+        return buffer_in;
+    }
 
-        // disable the timeout
-        tv = {0, 0};
-        setsockopt(pollfd->fd, SOL_SOCKET, SO_SNDTIMEO, (const void*)&tv, sizeof tv);
+    void setWatermarks(size_t high, size_t low) {
+        assert(low <= high);
+        high_watermark = high;
+        low_watermark = low;
+        updateCongestion();
+    }
+    // true iff the peer doesn't keep up with reading (see the watermarks), the owner decides what to do with it
+    [[nodiscard]] bool isCongested() const {
+        return congested;
+    }
+    [[nodiscard]] size_t queuedBytes() const {
+        return buffer_out.size();
+    }
+    [[nodiscard]] size_t peakQueuedBytes() const {
+        return peak_queued;
+    }
 
-        // Change the socket back to non-blocking mode (if it was non-blocking before).
-        fcntl(pollfd->fd, F_SETFL, flags);
+    void writeMessage(const Msg& message) {
+        writeMessage(binary ? message.toBinary() : message.toString());
+    }
+    void writeMessage(const WireMessage& message) {
+        writeMessage(message.encoded(binary));
+    }
+
+    [[nodiscard]] bool isConnected() const {
+        return pollfd != nullptr && pollfd->fd != -1;
+    }
+    [[nodiscard]] int fd() const {
+        assert(isConnected());
+        return pollfd->fd;
+    }
+
+    // Non-blocking replacement of a blocking flush for many buffers at once (e.g. at the end of the game):
+    // polls *only* for POLLOUT until all the output buffers are written or the shared deadline passes,
+    // so the total time is bounded by one timeout no matter how many peers are slow. Doesn't disconnect the buffers.
+    static void flushAll(const std::vector<PollBuffer*>& buffers, int64_t deadline_ms) {
+        std::vector<struct pollfd> fds;
+        std::vector<PollBuffer*> writing;
+        while (true) {
+            fds.clear();
+            writing.clear();
+            for (auto* buffer: buffers) {
+                if (buffer->isConnected() && !buffer->hasError() && buffer->isWriting()) {
+                    fds.push_back({.fd = buffer->pollfd->fd, .events = POLLOUT, .revents = 0});
+                    writing.push_back(buffer);
+                }
+            }
+            if (writing.empty()) return;
+
+            int64_t timeout_ms = deadline_ms - time_ms();
+            if (timeout_ms <= 0) {
+                Reporter::debug(Color::Red, "Flushing timed out with " + std::to_string(writing.size()) + " buffer(s) not fully written.");
+                return;
+            }
+            if (::poll(fds.data(), fds.size(), static_cast<int>(timeout_ms)) < 0) {
+                if (errno == EINTR) continue;
+                syserr("poll");
+            }
+            for (size_t i = 0; i < writing.size(); ++i) {
+                writing[i]->pollfd->revents = fds[i].revents;
+                if (!writing[i]->updateErrors()) {
+                    writing[i]->updatePollOut();
+                }
+            }
+        }
     }
 };
 
+// (the containers take their memory from the given resource, e.g. the arena of the server's table)
 struct PlayerStats {
     int points_deal = 0;
     int points_total = 0;
-    std::set<Card> hand;
-    std::vector<std::vector<Card>> tricks_taken; // in the last deal
+    std::pmr::set<Card> hand;
+    std::pmr::vector<std::pmr::vector<Card>> tricks_taken; // in the last deal
+
+    explicit PlayerStats(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : hand(resource), tricks_taken(resource) {}
+
     int getCurrentTrickNumber() const {
         // 1-based, deduced by hand size, it's 13 initially
         return 13 - hand.size() + 1;
@@ -1007,8 +1673,21 @@ struct PlayerStats {
         hand.erase(card);
     }
 
+    // Simple strategy of the robots: the first card of the leading suit (or just the first card if there's none).
+    [[nodiscard]] Card chooseLegalCard(const std::vector<Card>& cardsOnTable) const {
+        assert(!hand.empty());
+        if (!cardsOnTable.empty()) {
+            for (const auto& card: hand) {
+                if (card.suit == cardsOnTable[0].suit) {
+                    return card;
+                }
+            }
+        }
+        return *hand.begin();
+    }
+
     void takeTrick(const std::vector<Card>& cards, int points) {
-        tricks_taken.push_back(cards);
+        tricks_taken.emplace_back(cards.begin(), cards.end());
         points_deal += points;
         points_total += points;
     }
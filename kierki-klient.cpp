@@ -3,13 +3,16 @@
 struct ClientConfig {
     std::string host;
     int port{};
+    std::optional<std::string> localSocketPath; // connect over a Unix domain socket instead (server on the same host)
     enum IPAddressFamily {
         IPv4,
         IPv6,
         Unspecified
     } ipFamily = Unspecified;
     Seat seat{};
+    bool anySeat = false; // ask for any free seat (the server tells which one)
     bool isAutomatic = false;
+    bool binary = false; // compact binary encoding of the messages (for the robots)
 public:
     // use getopt()
     static ClientConfig FromArgs(int argc, char** argv) {
@@ -19,7 +22,7 @@ public:
         bool hostSet = false;
         bool portSet = false;
         bool seatSet = false;
-        while ((c = getopt(argc, argv, "h:p:46NESWa")) != -1) {
+        while ((c = getopt(argc, argv, "h:p:46NESWLaU:b")) != -1) {
             switch (c) {
                 case 'h':
                     config.host = optarg;
@@ -51,17 +54,27 @@ public:
                     config.seat = Seat::W;
                     seatSet = true;
                     break;
+                case 'L':
+                    config.anySeat = true;
+                    seatSet = true;
+                    break;
                 case 'a':
                     config.isAutomatic = true;
                     break;
+                case 'U':
+                    config.localSocketPath = optarg;
+                    break;
+                case 'b':
+                    config.binary = true;
+                    break;
                 default:
                     Reporter::error("Invalid argument. Exiting.");
                     exit(1);
             }
         }
 
-        if (!hostSet || !portSet || !seatSet) {
-            Reporter::logError("Missing mandatory arguments. Usage: " + std::string(argv[0]) + " -h host -p port -N|E|S|W -[4|6] [-a]");
+        if (!(config.localSocketPath || (hostSet && portSet)) || !seatSet) {
+            Reporter::logError("Missing mandatory arguments. Usage: " + std::string(argv[0]) + " -h host -p port | -U unix_socket_path -N|E|S|W|L -[4|6] [-a] [-b]");
 
             exit(1);
         }
@@ -136,7 +149,7 @@ class Client {
             else if (raw.substr(0, ShowTricksCommand.size()) == ShowTricksCommand) {
                 Reporter::toUser("Tricks taken in the last deal:");
                 for (const auto& cards: stats->tricks_taken) {
-                    Reporter::toUser(listToString<Card>(cards, [](const Card &card) { return card.toString(); }));
+                    Reporter::toUser(listToString(cards.begin(), cards.end(), [](const Card &card) { return card.toString(); }));
                 }
                 Reporter::toUser("--- End of list ---");
             }
@@ -173,15 +186,7 @@ class Client {
                 throw std::runtime_error("Player has NO CARDS in hand, but was asked to TRICK");
             }
             // choose the first suitable card from the stats->hand
-            if (serverTrick.cards.empty()) {
-                return *stats->hand.begin();
-            }
-            for (const auto& card: stats->hand) {
-                if (card.suit == serverTrick.cards[0].suit) {
-                    return card;
-                }
-            }
-            return *stats->hand.begin(); // if no suitable card, return the first one
+            return stats->chooseLegalCard(serverTrick.cards);
         }
     } robot = Robot(&stats);
 
@@ -231,6 +236,9 @@ class Client {
 
     // Creates and returns a socket connected to the server.
     [[nodiscard]] int server_socket() {
+        if (config.localSocketPath) {
+            return local_server_socket(*config.localSocketPath);
+        }
         // get the server address and other information
         auto server_address = get_server_address(config.host.c_str(), config.port, config.getIPFamily());
 
@@ -264,10 +272,35 @@ class Client {
         return socket_fd;
     }
 
+    // The same, but over a Unix domain socket (see the -u option of the server).
+    [[nodiscard]] static int local_server_socket(const std::string& path) {
+        struct sockaddr_un server_address{};
+        if (path.size() >= sizeof(server_address.sun_path)) {
+            fatal("Unix socket path is too long: %s", path.c_str());
+        }
+        server_address.sun_family = AF_UNIX;
+        memcpy(server_address.sun_path, path.c_str(), path.size() + 1);
+
+        Reporter::log("Connecting to server at the Unix socket " + path + ".");
+        int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket_fd < 0) {
+            syserr("socket");
+        }
+        if (connect(socket_fd, (struct sockaddr *) &server_address, sizeof server_address) < 0) {
+            syserr("connect");
+        }
+
+        // set to nonblocking mode
+        if (fcntl(socket_fd, F_SETFL, O_NONBLOCK)) {
+            syserr("fcntl");
+        }
+        return socket_fd;
+    }
+
     // usage: `auto [msg, raw] = readAndParse();`
     auto readAndParse() {
         auto raw = Server.readMessage();
-        auto msg = Parser::parse(raw);
+        auto msg = Parser::parse(raw, Server.isBinary());
         return std::make_pair(msg, raw);
     }
 
@@ -291,7 +324,7 @@ class Client {
         if (!Server.hasMessage()) { return; }
 
         auto raw = Server.readMessage();
-        auto msg = Parser::parse(raw);
+        auto msg = Parser::parse(raw, Server.isBinary());
 
         if (auto deal = std::dynamic_pointer_cast<Deal>(msg)) {
             if (not config.isAutomatic) Reporter::toUser(deal->toStringVerbose());
@@ -302,6 +335,12 @@ class Client {
             if (not config.isAutomatic) Reporter::toUser(busy->toStringVerbose());
             exit(1); // exit with error because the seat is taken
         }
+        else if (auto iam = std::dynamic_pointer_cast<IAm>(msg); iam && config.anySeat) {
+            // the answer to IAM* (it comes before the DEAL)
+            config.seat = iam->seat;
+            Reporter::log("Seated at " + ::seatToString(config.seat) + ".");
+            if (not config.isAutomatic) Reporter::toUser("You are seated at " + ::seatToString(config.seat) + ".");
+        }
         else {
             Reporter::logWarning("Skipped unexpected message from the server: " + raw);
         }
@@ -334,7 +373,7 @@ class Client {
         // here we expect the server only to resend us the trick message
         if (Server.hasMessage()) {
             auto raw = Server.readMessage();
-            auto msg = Parser::parse(raw);
+            auto msg = Parser::parse(raw, Server.isBinary());
             if (auto trick = std::dynamic_pointer_cast<Trick>(msg)) {
                 if (not config.isAutomatic) Reporter::toUser(trick->toStringVerbose()); // print the first part of the trick message
                 if (not config.isAutomatic) Reporter::toUser(stats.availableCardsToString()); // and print the cards available to trick
@@ -401,7 +440,7 @@ class Client {
         if (!Server.hasMessage()) { return; }
 
         auto raw = Server.readMessage();
-        auto msg = Parser::parse(raw);
+        auto msg = Parser::parse(raw, Server.isBinary());
         if (auto total = std::dynamic_pointer_cast<Total>(msg)) {
             if (not config.isAutomatic) Reporter::toUser(total->toStringVerbose());
             ChangeState([this] { stateWaitForNewDeal(); });
@@ -435,11 +474,12 @@ public:
     explicit Client(ClientConfig config): config(std::move(config)), Server() {}
 
     [[noreturn]] void run() {
-        Reporter::log("Starting the client for seat " + ::seatToString(config.seat) + ".");
+        Reporter::log("Starting the client for " + (config.anySeat ? std::string("any seat") : "seat " + ::seatToString(config.seat)) + ".");
         setup_poll_and_buffers();
 
         // send IAM message to the server
-        Server.writeMessage(IAm(config.seat));
+        Server.writeMessage(config.anySeat ? IAm::any(config.binary) : IAm(config.seat, config.binary));
+        Server.setBinary(config.binary); // (the answer is already in the chosen encoding)
         state = [this] { stateWaitForNewDeal(); };
 
         while (true) {
@@ -1,51 +1,799 @@
 #include "common.h"
 
 
+// Compact, fixed-size record of one deal (no per-deal heap allocations).
 struct DealConfig {
+    static constexpr int CardsPerSeat = 13;
     DealType dealType{};
     Seat firstSeat{};
-    std::unordered_map<Seat, std::vector<Card>> cards;
+    uint8_t cards[4][CardsPerSeat]{}; // Card::index() of the cards of each seat, rows in the NESW order
+
+    [[nodiscard]] std::vector<Card> cardsOf(Seat seat) const {
+        std::vector<Card> result;
+        result.reserve(CardsPerSeat);
+        for (uint8_t cardIndex: cards[seatIndex(seat)]) {
+            result.push_back(Card::fromIndex(cardIndex));
+        }
+        return result;
+    }
 };
 using time_ms_t = int64_t;
 
-class ServerConfig {
-private:
-    static std::vector<DealConfig> readDealsFromFile(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
+// Global heap allocations of the current thread: the operator new below counts them (and their bytes), so that the
+// server (per deal, see Server::Metrics) and the benchmarks can tell whether a path allocates at all. Counting is
+// two thread-local additions.
+struct AllocationCounter {
+    static inline thread_local uint64_t count = 0;
+    static inline thread_local uint64_t bytes = 0;
+};
+
+void* operator new(size_t size) {
+    AllocationCounter::count++;
+    AllocationCounter::bytes += size;
+    if (void* memory = malloc(size == 0 ? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    AllocationCounter::count++;
+    AllocationCounter::bytes += size;
+    return malloc(size == 0 ? 1 : size);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    AllocationCounter::count++;
+    AllocationCounter::bytes += size;
+    auto align = static_cast<size_t>(alignment);
+    return aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align); // (a multiple of the alignment)
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    if (void* memory = operator new(size, alignment, std::nothrow)) return memory;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept { return operator new(size, alignment, tag); }
+// (the default operators delete free with free(), the aligned ones too, so they stay)
+
+// Read-only memory mapping of a whole file (unmapped when destroyed).
+class MappedFile {
+    const char* _data = nullptr;
+    size_t _size = 0;
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
             Reporter::error("Cannot open file: " + filename);
             exit(1);
         }
+        struct stat st{};
+        if (fstat(fd, &st) < 0) {
+            syserr("fstat");
+        }
+        _size = static_cast<size_t>(st.st_size);
+        if (_size > 0) {
+            void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                syserr("mmap");
+            }
+            madvise(data, _size, MADV_SEQUENTIAL);
+            _data = static_cast<const char*>(data);
+        }
+        close(fd); // the mapping stays valid after closing the descriptor
+    }
+    ~MappedFile() {
+        if (_data != nullptr)
+            munmap(const_cast<char*>(_data), _size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] const char* begin() const { return _data; }
+    [[nodiscard]] const char* end() const { return _data + _size; }
+    [[nodiscard]] size_t size() const { return _size; }
+};
+
+/* Parser of the deal file. Format of one deal:
+ * <typ rozdania><miejsce przy stole klienta wychodzącego jako pierwszy w rozdaniu>\n
+ * <lista kart klienta N>\n
+ * <lista kart klienta E>\n
+ * <lista kart klienta S>\n
+ * <lista kart klienta W>\n
+ * The file is memory-mapped and big files are split into chunks (aligned to the deal headers) parsed in parallel.
+ */
+class DealFileParser {
+    static constexpr size_t MinChunkBytes = 1 << 20;
+
+    // returns the line starting at 'it' (without "\r\n") and moves 'it' to the beginning of the next line
+    static std::string_view nextLine(const char*& it, const char* end) {
+        const char* lineEnd = static_cast<const char*>(memchr(it, '\n', end - it));
+        if (lineEnd == nullptr) lineEnd = end;
+        std::string_view line(it, lineEnd - it);
+        it = lineEnd == end ? end : lineEnd + 1;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        return line;
+    }
+
+    // header lines are the only short lines in the file (the card lines have at least 26 characters)
+    static bool isHeaderLine(std::string_view line) {
+        return line.size() == 2 && line[0] >= '1' && line[0] <= '7' && isSeatChar(line[1]);
+    }
 
+    // first header line at or after 'it' (which must point at the beginning of a line)
+    static const char* findHeader(const char* it, const char* end) {
+        while (it != end) {
+            const char* lineStart = it;
+            if (isHeaderLine(nextLine(it, end))) return lineStart;
+        }
+        return end;
+    }
+
+    // number of lines between 'it' and 'end' (both at the beginning of a line)
+    static size_t countLines(const char* it, const char* end) {
+        return std::count(it, end, '\n') + (end != it && end[-1] != '\n');
+    }
+
+    // parses exactly 13 cards, returns the description of the problem (or an empty string if the line is correct)
+    static std::string parseCardsLine(std::string_view line, uint8_t (&cards)[DealConfig::CardsPerSeat], uint64_t& seenCards) {
+        const char* it = line.data();
+        const char* end = line.data() + line.size();
+        int count = 0;
+        while (it != end) {
+            auto card = Parser::parseCard(it, end);
+            if (!card) {
+                return "malformed card at column " + std::to_string(it - line.data() + 1);
+            }
+            if (count == DealConfig::CardsPerSeat) {
+                return "more than " + std::to_string(DealConfig::CardsPerSeat) + " cards";
+            }
+            uint64_t cardBit = uint64_t{1} << card->index();
+            if (seenCards & cardBit) {
+                return "repeated card " + card->toString();
+            }
+            seenCards |= cardBit;
+            cards[count++] = card->index();
+        }
+        if (count != DealConfig::CardsPerSeat) {
+            return std::to_string(count) + " cards instead of " + std::to_string(DealConfig::CardsPerSeat);
+        }
+        return "";
+    }
+
+public:
+    struct Error {
+        size_t line; // 1-based line number in the file
+        std::string message;
+    };
+
+private:
+    struct Chunk {
         std::vector<DealConfig> deals;
-        /* Read file for multiple DealConfigs:
-         * Format of one DealConfig:
-         * <typ rozdania><miejsce przy stole klienta wychodzącego jako pierwszy w rozdaniu>\n
-            <lista kart klienta N>\n
-            <lista kart klienta E>\n
-            <lista kart klienta S>\n
-            <lista kart klienta W>\n
-         */
-        std::string line;
-        while (std::getline(file, line)) {
-            DealConfig dealConfig;
-            dealConfig.dealType = static_cast<DealType>(line[0] - '0');
-            dealConfig.firstSeat = Seat(line[1]);
-            for (int i = 0; i < 4; ++i) {
-                std::getline(file, line);
-                auto cards = Parser::parseCards(line);
-                dealConfig.cards[Seat("NESW"[i])] = cards;
+        std::vector<Error> errors; // with line numbers relative to the chunk
+        size_t lines = 0;
+    };
+
+    // Parses and validates the deals from [it, end), a bad deal is reported and skipped (the parsing resumes at the next header).
+    static void parseChunk(const char* it, const char* end, Chunk& chunk) {
+        while (it != end) {
+            size_t headerLine = ++chunk.lines;
+            auto header = nextLine(it, end);
+            if (header.empty()) continue; // tolerate blank lines (e.g. at the end of the file)
+            if (!isHeaderLine(header)) {
+                chunk.errors.push_back({headerLine, "invalid deal header '" + std::string(header) + "' (expected a deal type 1-7 and a seat N, E, S or W)"});
+                const char* nextHeader = findHeader(it, end);
+                chunk.lines += countLines(it, nextHeader);
+                it = nextHeader;
+                continue;
+            }
+
+            DealConfig deal;
+            deal.dealType = static_cast<DealType>(header[0] - '0');
+            deal.firstSeat = Seat(header[1]);
+            uint64_t seenCards = 0;
+            bool valid = true;
+            for (int seat = 0; seat < 4; ++seat) {
+                const char* lineStart = it;
+                auto line = nextLine(it, end);
+                if (lineStart == end || isHeaderLine(line)) {
+                    it = lineStart; // the deal is truncated, the next one starts here
+                    chunk.errors.push_back({headerLine, "deal is truncated (missing cards of " + ::seatToString(seatFromIndex(seat)) + ")"});
+                    valid = false;
+                    break;
+                }
+                ++chunk.lines;
+                auto problem = parseCardsLine(line, deal.cards[seat], seenCards);
+                if (!problem.empty()) {
+                    chunk.errors.push_back({chunk.lines, "cards of " + ::seatToString(seatFromIndex(seat)) + ": " + problem});
+                    valid = false;
+                }
+            }
+            // 4 x 13 distinct cards always make up the whole deck
+            if (valid) {
+                chunk.deals.push_back(deal);
+            }
+        }
+    }
+
+public:
+    // Parses and validates the whole file, every bad deal is appended to errors (and not returned).
+    static std::vector<DealConfig> parse(const MappedFile& file, std::vector<Error>& errors) {
+        const char* begin = file.begin();
+        const char* end = file.end();
+        if (begin == nullptr) return {};
+
+        size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        size_t chunksCount = std::clamp<size_t>(file.size() / MinChunkBytes, 1, threads);
+
+        // split the file into chunks starting at deal headers
+        std::vector<const char*> bounds{begin};
+        for (size_t i = 1; i < chunksCount; ++i) {
+            const char* it = begin + file.size() * i / chunksCount;
+            nextLine(it, end); // skip to the beginning of the next line
+            bounds.push_back(std::max(bounds.back(), findHeader(it, end)));
+        }
+        bounds.push_back(end);
+
+        std::vector<Chunk> chunks(chunksCount);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i + 1 < chunksCount; ++i) {
+            workers.emplace_back([&, i] { parseChunk(bounds[i], bounds[i + 1], chunks[i]); });
+        }
+        parseChunk(bounds[chunksCount - 1], end, chunks.back()); // the last chunk is parsed by the calling thread
+        for (auto& worker: workers) worker.join();
+
+        // merge the chunks, translating the line numbers
+        size_t firstLine = 0;
+        for (auto& chunk: chunks) {
+            for (auto& error: chunk.errors) {
+                errors.push_back({firstLine + error.line, std::move(error.message)});
+            }
+            firstLine += chunk.lines;
+        }
+        if (chunksCount == 1) return std::move(chunks[0].deals);
+        size_t total = 0;
+        for (auto& chunk: chunks) total += chunk.deals.size();
+        std::vector<DealConfig> deals;
+        deals.reserve(total);
+        for (auto& chunk: chunks) deals.insert(deals.end(), chunk.deals.begin(), chunk.deals.end());
+        return deals;
+    }
+
+    // Prints all the errors, returns true iff there were none.
+    static bool report(const std::string& filename, const std::vector<Error>& errors) {
+        for (const auto& error: errors) {
+            Reporter::logError(filename + ":" + std::to_string(error.line) + ": " + error.message);
+        }
+        if (!errors.empty()) {
+            Reporter::error("Deal file " + filename + " has " + std::to_string(errors.size()) + " error(s).");
+        }
+        return errors.empty();
+    }
+
+    // Implementation of `kierki-serwer --check-deals <in.txt>`.
+    static int check(const std::string& filename) {
+        MappedFile file(filename);
+        std::vector<Error> errors;
+        auto deals = parse(file, errors);
+        if (!report(filename, errors)) return 1;
+        Reporter::log("All " + std::to_string(deals.size()) + " deals in " + filename + " are correct.");
+        return 0;
+    }
+};
+
+/* Precompiled binary deal pack (see `--compile-deals`), served directly from a memory mapping.
+ * Layout (little-endian): Header followed by dealCount records of RecordSize bytes:
+ *  - 13 bytes of seat ownership: 2 bits (seat index in the NESW order) per Card::index(), 4 cards per byte,
+ *  - 1 byte: (deal type << 2) | first seat index.
+ */
+class DealPack {
+public:
+    static constexpr char Magic[8] = {'K', 'I', 'E', 'R', 'P', 'A', 'C', 'K'};
+    static constexpr uint32_t Version = 1;
+    static constexpr uint32_t RecordSize = 14;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordSize;
+        uint64_t dealCount;
+        uint64_t checksum; // FNV-1a of all the records
+    };
+    static_assert(sizeof(Header) == 32);
+
+    // (the numbers are stored little-endian, on any host)
+    static Header toLittleEndian(Header header) {
+        header.version = htole32(header.version);
+        header.recordSize = htole32(header.recordSize);
+        header.dealCount = htole64(header.dealCount);
+        header.checksum = htole64(header.checksum);
+        return header;
+    }
+    static Header fromLittleEndian(Header header) {
+        header.version = le32toh(header.version);
+        header.recordSize = le32toh(header.recordSize);
+        header.dealCount = le64toh(header.dealCount);
+        header.checksum = le64toh(header.checksum);
+        return header;
+    }
+
+    static uint64_t checksum(const uint8_t* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    static bool isPack(const MappedFile& file) {
+        return file.size() >= sizeof(Header) && memcmp(file.begin(), Magic, sizeof(Magic)) == 0;
+    }
+
+    static void encode(const DealConfig& deal, uint8_t* record) {
+        memset(record, 0, RecordSize);
+        for (int seat = 0; seat < 4; ++seat) {
+            for (uint8_t cardIndex: deal.cards[seat]) {
+                record[cardIndex / 4] |= static_cast<uint8_t>(seat << (cardIndex % 4 * 2));
+            }
+        }
+        record[13] = static_cast<uint8_t>(static_cast<int>(deal.dealType) << 2 | seatIndex(deal.firstSeat));
+    }
+
+    // returns false if the record is corrupted (e.g. not 13 cards per seat)
+    static bool decode(const uint8_t* record, DealConfig& deal) {
+        int dealType = record[13] >> 2;
+        if (dealType < static_cast<int>(DealType::NoTricks) || dealType > static_cast<int>(DealType::Robber)) {
+            return false;
+        }
+        deal.dealType = static_cast<DealType>(dealType);
+        deal.firstSeat = seatFromIndex(record[13] & 3);
+        int counts[4]{};
+        for (uint8_t cardIndex = 0; cardIndex < Card::DeckSize; ++cardIndex) {
+            int seat = record[cardIndex / 4] >> (cardIndex % 4 * 2) & 3;
+            if (counts[seat] == DealConfig::CardsPerSeat) return false;
+            deal.cards[seat][counts[seat]++] = cardIndex;
+        }
+        return true;
+    }
+
+    // Implementation of `kierki-serwer --compile-deals <in.txt> <out.pack>`.
+    static int compile(const std::string& inFilename, const std::string& outFilename) {
+        MappedFile in(inFilename);
+        std::vector<DealFileParser::Error> errors;
+        std::vector<DealConfig> deals = DealFileParser::parse(in, errors);
+        if (!DealFileParser::report(inFilename, errors)) {
+            return 1;
+        }
+
+        std::vector<uint8_t> records(deals.size() * RecordSize);
+        for (size_t i = 0; i < deals.size(); ++i) {
+            encode(deals[i], &records[i * RecordSize]);
+        }
+
+        Header header{};
+        memcpy(header.magic, Magic, sizeof(Magic));
+        header.version = Version;
+        header.recordSize = RecordSize;
+        header.dealCount = deals.size();
+        header.checksum = checksum(records.data(), records.size());
+        header = toLittleEndian(header);
+
+        std::ofstream out(outFilename, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size()));
+        if (!out.flush()) {
+            Reporter::error("Cannot write file: " + outFilename);
+            return 1;
+        }
+        Reporter::log("Compiled " + std::to_string(deals.size()) + " deals into: " + outFilename);
+        return 0;
+    }
+};
+
+// Reproducible, endless deal generator (`-g <seed>`): deal i depends only on the seed and i, so any deal can be recreated on demand.
+class DealGenerator {
+    uint64_t seed;
+    std::vector<DealType> rotation;
+
+    // SplitMix64 - tiny and fast, good enough for shuffling cards
+    static uint64_t nextRandom(uint64_t& state) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+public:
+    DealGenerator(uint64_t seed, std::vector<DealType> rotation) : seed(seed), rotation(std::move(rotation)) {
+        assert(!this->rotation.empty());
+    }
+
+    // Parses the deal type rotation, e.g. "1234567" or "77".
+    static std::vector<DealType> parseRotation(const std::string& digits) {
+        std::vector<DealType> rotation;
+        for (char digit: digits) {
+            if (digit < '1' || digit > '7') {
+                throw std::invalid_argument("invalid deal type in rotation: " + digits);
+            }
+            rotation.push_back(static_cast<DealType>(digit - '0'));
+        }
+        if (rotation.empty()) {
+            throw std::invalid_argument("empty deal type rotation");
+        }
+        return rotation;
+    }
+
+    [[nodiscard]] DealConfig generate(size_t index) const {
+        DealConfig deal;
+        deal.dealType = rotation[index % rotation.size()];
+        deal.firstSeat = seatFromIndex(static_cast<int>(index % 4));
+
+        // Fisher-Yates shuffle of the deck, dealt straight into per-seat card masks
+        uint64_t state = seed ^ (index * 0xd1b54a32d192ed03ULL);
+        uint8_t deck[Card::DeckSize];
+        for (uint8_t i = 0; i < Card::DeckSize; ++i) deck[i] = i;
+        uint64_t seatMasks[4]{};
+        for (int i = Card::DeckSize - 1; i >= 0; --i) {
+            // multiply-shift instead of modulo to pick j from [0, i]
+            auto j = static_cast<int>((static_cast<unsigned __int128>(nextRandom(state)) * (i + 1)) >> 64);
+            std::swap(deck[i], deck[j]);
+            seatMasks[i / DealConfig::CardsPerSeat] |= uint64_t{1} << deck[i];
+        }
+
+        for (int seat = 0; seat < 4; ++seat) {
+            uint64_t mask = seatMasks[seat];
+            for (auto& cardIndex: deal.cards[seat]) {
+                cardIndex = static_cast<uint8_t>(__builtin_ctzll(mask));
+                mask &= mask - 1;
+            }
+        }
+        return deal;
+    }
+};
+
+// Deals played by the server: either parsed from a text file, decoded on demand from a memory-mapped deal pack
+// or generated on demand (then there are endlessly many of them).
+class DealSource {
+    std::vector<DealConfig> parsed;
+    std::shared_ptr<const MappedFile> pack;
+    const uint8_t* records = nullptr;
+    size_t packDeals = 0;
+    std::optional<DealGenerator> generator;
+public:
+    DealSource() = default;
+    explicit DealSource(std::vector<DealConfig> deals) : parsed(std::move(deals)) {}
+    explicit DealSource(DealGenerator generator) : generator(std::move(generator)) {}
+
+    // Opens the deal pack in O(1) - only the header and the size are checked (and the whole checksum if verify is set,
+    // see `--check-deals` and -v); a corrupted record is found by decoding it (see at()).
+    static DealSource FromPack(std::shared_ptr<const MappedFile> file, bool verify) {
+        DealPack::Header header{};
+        memcpy(&header, file->begin(), sizeof(header));
+        header = DealPack::fromLittleEndian(header);
+        if (header.version != DealPack::Version || header.recordSize != DealPack::RecordSize ||
+            (file->size() - sizeof(header)) % DealPack::RecordSize != 0 ||
+            header.dealCount != (file->size() - sizeof(header)) / DealPack::RecordSize) {
+            throw std::invalid_argument("corrupted or incompatible deal pack");
+        }
+        DealSource source;
+        source.records = reinterpret_cast<const uint8_t*>(file->begin()) + sizeof(header);
+        source.packDeals = header.dealCount;
+        if (verify && DealPack::checksum(source.records, source.packDeals * DealPack::RecordSize) != header.checksum) {
+            throw std::invalid_argument("deal pack checksum mismatch");
+        }
+        madvise(const_cast<char*>(file->begin()), file->size(), MADV_RANDOM);
+        source.pack = std::move(file);
+        return source;
+    }
+
+    [[nodiscard]] bool isEndless() const { return generator.has_value(); }
+    [[nodiscard]] size_t size() const {
+        if (generator) return SIZE_MAX;
+        return pack ? packDeals : parsed.size();
+    }
+    [[nodiscard]] bool empty() const { return size() == 0; }
+
+    [[nodiscard]] DealConfig at(size_t index) const {
+        assert(index < size());
+        if (generator) return generator->generate(index);
+        if (!pack) return parsed[index];
+        DealConfig deal;
+        if (!DealPack::decode(records + index * DealPack::RecordSize, deal)) {
+            fatal("Deal pack is corrupted (deal %zu).", index + 1);
+        }
+        return deal;
+    }
+
+    // Implementation of `kierki-serwer --check-deals <in.pack>`: the checksum and every record.
+    static int checkPack(const std::string& filename) {
+        auto file = std::make_shared<const MappedFile>(filename);
+        DealSource deals;
+        try {
+            deals = FromPack(file, true);
+        }
+        catch (std::invalid_argument& e) {
+            Reporter::error("Deal pack " + filename + ": " + e.what());
+            return 1;
+        }
+        DealConfig deal;
+        for (size_t i = 0; i < deals.size(); ++i) {
+            if (!DealPack::decode(deals.records + i * DealPack::RecordSize, deal)) {
+                Reporter::error("Deal pack " + filename + " is corrupted (deal " + std::to_string(i + 1) + ").");
+                return 1;
+            }
+        }
+        Reporter::log("All " + std::to_string(deals.size()) + " deals in " + filename + " are correct.");
+        return 0;
+    }
+};
+
+/* Snapshot of the table for crash recovery (`-s <file>`), saved at every trick boundary (so there are never cards
+ * on the table) into a memory-mapped file. Saving is just a memcpy into the shared mapping - no syscalls, and the
+ * page cache keeps the data even if the process dies. The snapshot is written alternately into two slots, each
+ * with a sequence number and a checksum, so a crash in the middle of a write leaves the previous snapshot intact.
+ */
+class TableSnapshot {
+public:
+    static constexpr char Magic[8] = {'K', 'I', 'E', 'R', 'S', 'N', 'A', 'P'};
+    static constexpr uint32_t Version = 1;
+
+    struct State {
+        uint64_t dealIndex;
+        uint64_t hands[4]; // bitmasks of Card::index() (by seatIndex)
+        int32_t pointsDeal[4];
+        int32_t pointsTotal[4];
+        uint8_t takenCount; // the next trick is takenCount + 1
+        uint8_t taken[Trick::LastTrickNumber][5]; // 4 cards (Card::index()) and the taker's seatIndex of each trick
+        uint8_t reserved[6];
+    };
+    static_assert(sizeof(State) == 144);
+    struct Slot {
+        uint64_t sequence; // 0 - empty
+        uint64_t checksum; // FNV-1a of the state
+        State state;
+    };
+    struct Layout {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        Slot slots[2];
+    };
+
+private:
+    Layout* layout = nullptr;
+
+    static uint64_t checksum(const State& state) {
+        return DealPack::checksum(reinterpret_cast<const uint8_t*>(&state), sizeof(state));
+    }
+
+    [[nodiscard]] const Slot* _latestValidSlot() const {
+        const Slot* latest = nullptr;
+        for (const auto& slot: layout->slots) {
+            if (slot.sequence != 0 && slot.checksum == checksum(slot.state) &&
+                (latest == nullptr || slot.sequence > latest->sequence)) {
+                latest = &slot;
+            }
+        }
+        return latest;
+    }
+
+public:
+    explicit TableSnapshot(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            syserr("cannot open the snapshot file %s", filename.c_str());
+        }
+        if (ftruncate(fd, sizeof(Layout)) < 0) {
+            syserr("ftruncate");
+        }
+        void* data = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            syserr("mmap");
+        }
+        close(fd); // the mapping stays valid after closing the descriptor
+        layout = static_cast<Layout*>(data);
+
+        if (memcmp(layout->magic, Magic, sizeof(Magic)) != 0 || layout->version != Version) {
+            memset(layout, 0, sizeof(Layout)); // a new (or incompatible) file
+            memcpy(layout->magic, Magic, sizeof(Magic));
+            layout->version = Version;
+        }
+    }
+    ~TableSnapshot() {
+        munmap(layout, sizeof(Layout));
+    }
+    TableSnapshot(const TableSnapshot&) = delete;
+    TableSnapshot& operator=(const TableSnapshot&) = delete;
+
+    [[nodiscard]] std::optional<State> load() const {
+        const Slot* slot = _latestValidSlot();
+        if (slot == nullptr) return std::nullopt;
+        return slot->state;
+    }
+
+    void save(const State& state) {
+        const Slot* latest = _latestValidSlot();
+        uint64_t sequence = latest ? latest->sequence + 1 : 1;
+        Slot& slot = layout->slots[sequence % 2]; // never the latest one
+        slot.sequence = 0;
+        std::atomic_signal_fence(std::memory_order_seq_cst); // (keep the order of the stores)
+        slot.state = state;
+        slot.checksum = checksum(state);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        slot.sequence = sequence;
+    }
+
+    // nothing to restore (e.g. the game is over)
+    void clear() {
+        for (auto& slot: layout->slots) {
+            slot.sequence = 0;
+        }
+    }
+};
+
+/* Zero-downtime restart (`-H <path>`): the server listens on a Unix domain socket at the path. A new server started
+ * with the same path connects there, and the running one passes it (with SCM_RIGHTS) its listening socket and the
+ * players' sockets together with the state of the table, then exits - the players don't notice anything.
+ * It happens between the tricks (or before the game starts), so there is never a TRICK in flight; whatever the players
+ * have sent and the old server hasn't read yet follows the header.
+ */
+class Handoff {
+public:
+    static constexpr char Magic[8] = {'K', 'I', 'E', 'R', 'H', 'A', 'N', 'D'};
+    static constexpr uint32_t Version = 4;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint8_t started; // the state is valid only if the game has started
+        uint8_t connectedSeats; // bitmask (by seatIndex) of the seats whose sockets follow the listening socket
+        uint8_t robotSeats; // bitmask of the seats played by the robots
+        uint8_t localListener; // whether the AF_UNIX listening socket follows the TCP one
+        uint8_t binarySeats; // bitmask of the seats whose players use the binary encoding
+        uint32_t inputSizes[4]; // bytes of the unread input of the connected seats (by seatIndex), sent after the header
+        TableSnapshot::State state;
+    };
+
+private:
+    static sockaddr_un address(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            fatal("Handoff socket path is too long: %s", path.c_str());
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+public:
+    // Connects to the running server, or returns -1 if there is none.
+    static int connectToPredecessor(const std::string& path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            syserr("cannot create a socket");
+        }
+        sockaddr_un addr = address(path);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+            if (errno == ENOENT || errno == ECONNREFUSED) {
+                close(fd);
+                return -1;
+            }
+            syserr("connect %s", path.c_str());
+        }
+        return fd;
+    }
+
+    static int listenForSuccessor(const std::string& path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            syserr("cannot create a socket");
+        }
+        unlink(path.c_str()); // (the socket of the predecessor or of a crashed server)
+        sockaddr_un addr = address(path);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+            syserr("bind %s", path.c_str());
+        }
+        if (listen(fd, 1) < 0) {
+            syserr("listen");
+        }
+        return fd;
+    }
+
+    // Returns false if the successor is gone (then the server just goes on).
+    static bool send(int peer, const Header& header, const std::vector<int>& fds, std::string_view input) {
+        iovec iov{.iov_base = const_cast<Header*>(&header), .iov_len = sizeof header};
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        if (sendmsg(peer, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof header)) {
+            return false;
+        }
+        while (!input.empty()) {
+            ssize_t size = ::send(peer, input.data(), input.size(), MSG_NOSIGNAL);
+            if (size < 0 && errno == EINTR) continue;
+            if (size <= 0) return false;
+            input.remove_prefix(size);
+        }
+        return true;
+    }
+
+    // Blocks until the predecessor is ready to hand over (at most timeout_ms); fds get the listening socket(s) and
+    // the players' sockets, input gets the players' unread input (see Header::inputSizes).
+    static bool receive(int peer, Header& header, std::vector<int>& fds, std::string& input, time_ms_t timeout_ms) {
+        timeval timeout{.tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000};
+        if (setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0) {
+            syserr("setsockopt SO_RCVTIMEO");
+        }
+        iovec iov{.iov_base = &header, .iov_len = sizeof header};
+        char control[CMSG_SPACE(sizeof(int) * 6)]{};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        ssize_t size;
+        do {
+            size = recvmsg(peer, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        } while (size < 0 && errno == EINTR);
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.resize(count);
+                memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+            }
+        }
+        if (size != static_cast<ssize_t>(sizeof header) || memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+            header.version != Version || (msg.msg_flags & MSG_CTRUNC) ||
+            std::ssize(fds) != 1 + header.localListener + std::popcount(header.connectedSeats)) {
+            return false;
+        }
+        size_t inputSize = 0;
+        for (uint32_t seatInput: header.inputSizes) {
+            inputSize += seatInput;
+        }
+        input.resize(inputSize);
+        for (size_t received = 0; received < inputSize;) {
+            size = recv(peer, input.data() + received, inputSize - received, MSG_WAITALL);
+            if (size < 0 && errno == EINTR) continue;
+            if (size <= 0) return false; // (also on the timeout)
+            received += size;
+        }
+        return true;
+    }
+};
+
+class ServerConfig {
+private:
+    static DealSource readDealsFromFile(const std::string& filename, bool verbose) {
+        auto file = std::make_shared<const MappedFile>(filename);
+        DealSource deals;
+        if (DealPack::isPack(*file)) {
+            deals = DealSource::FromPack(file, verbose);
+        }
+        else {
+            std::vector<DealFileParser::Error> errors;
+            deals = DealSource(DealFileParser::parse(*file, errors));
+            if (!DealFileParser::report(filename, errors)) {
+                exit(1);
             }
-            deals.push_back(dealConfig);
         }
 
-        // print what the server has read from the file
         Reporter::log("Read " + std::to_string(deals.size()) + " deals from file: " + filename);
-        for (const auto& deal: deals) {
-            Reporter::log("Deal: " + std::to_string(static_cast<int>(deal.dealType)) + " " +
-                                  ::seatToString(deal.firstSeat));
-            for (const auto& [seat, cards]: deal.cards) {
-                Reporter::log("  " + ::seatToString(seat) + ": " + listToString<Card>(cards, [](const Card& c) { return c.toString(); }));
+        if (verbose) {
+            // print what the server has read from the file
+            for (size_t i = 0; i < deals.size(); ++i) {
+                DealConfig deal = deals.at(i);
+                Reporter::log("Deal: " + std::to_string(static_cast<int>(deal.dealType)) + " " +
+                                      ::seatToString(deal.firstSeat));
+                for (int seat = 0; seat < 4; ++seat) {
+                    Reporter::log("  " + ::seatToString(seatFromIndex(seat)) + ": " + listToString<Card>(deal.cardsOf(seatFromIndex(seat)), [](const Card& c) { return c.toString(); }));
+                }
             }
         }
 
@@ -54,30 +802,142 @@ private:
     int timeout_seconds = 5;
 public:
     std::optional<int> port;
-    std::vector<DealConfig> deals;
+    DealSource deals;
+    bool verbose = false; // echo the loaded deals
+    std::optional<uint64_t> seed; // generate the deals instead of reading them
+    bool persistent = false; // start a new game after the last deal instead of exiting
+
+    // output backpressure: what to do with a connection whose unsent output exceeds the high watermark
+    enum class SlowConsumerPolicy {
+        Disconnect, // treat it as a disconnection (the player may reconnect and get the history again)
+        PauseTable, // stop the game until it drains below the low watermark
+    } slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+    size_t outputHighWatermark = 64 * 1024;
+
+    // admission limits for the connections without a seat yet (by default only the free pollfd slots limit them, see
+    // Server::_maxCandidates)
+    std::optional<int> maxCandidates;
+    std::optional<int> maxCandidatesPerIP;
+    // connections over the candidate limits are parked (see IdleConnections) instead of rejected, up to this many
+    size_t maxParked = 0;
+    size_t maxParkedPerIP = 1024; // (a lobby behind a NAT needs more than the candidates)
+    // the connections asking for any seat (IAM*) wait in a queue for a free seat instead of getting BUSY
+    bool lobby = false;
+    time_ms_t lobbyTimeout_ms = 300 * 1000; // (how long one may wait there)
+    // if set, the table is saved there at every trick boundary and restored from there after a restart
+    std::optional<std::string> snapshotFilename;
+    // if set, the server also accepts the clients on this Unix domain socket (for the co-located robots)
+    std::optional<std::string> localSocketPath;
+    // if set, a new server started with the same path takes over the running one (see Handoff)
+    std::optional<std::string> handoffPath;
+    // read-only observers of the table (connections that send WATCH instead of IAM)
+    int maxObservers = 4096;
+    // if set, the counters and the latency metrics are served in the Prometheus text format on 127.0.0.1:<port>
+    std::optional<int> metricsPort;
+    // if set, the timeline of the server (states, polls, messages) is appended there (see Tracer)
+    std::optional<std::string> traceFilename;
+
+    // if set, a seat whose player has been disconnected for so long is played by the server until he comes back
+    std::optional<time_ms_t> robotGrace_ms;
+    [[nodiscard]] size_t outputLowWatermark() const { return outputHighWatermark / 4; }
     [[nodiscard]] int timeout_s() const { return timeout_seconds; }
     [[nodiscard]] time_ms_t timeout_ms() const { return timeout_seconds * 1000; }
 
     static ServerConfig FromArgs(int argc, char** argv) {
         ServerConfig config;
         int c;
+        std::optional<std::string> dealsFilename;
+        std::string rotation = "1234567";
         try {
-            while ((c = getopt(argc, argv, "p:f:t:")) != -1) {
+            while ((c = getopt(argc, argv, "p:f:t:vg:d:ro:O:c:C:R:w:s:H:u:m:T:i:I:Ll:")) != -1) {
                 switch (c) {
                     case 'p':
                         config.port = std::stoi(optarg);
                         break;
                     case 'f':
-                        config.deals = readDealsFromFile(optarg);
+                        dealsFilename = optarg;
                         break;
                     case 't':
                         config.timeout_seconds = std::stoi(optarg);
                         break;
+                    case 'v':
+                        config.verbose = true;
+                        break;
+                    case 'g':
+                        config.seed = std::stoull(optarg);
+                        break;
+                    case 'd':
+                        rotation = optarg;
+                        break;
+                    case 'r':
+                        config.persistent = true;
+                        break;
+                    case 'o':
+                        config.outputHighWatermark = std::stoull(optarg);
+                        break;
+                    case 'R':
+                        config.robotGrace_ms = std::stoi(optarg) * time_ms_t{1000};
+                        break;
+                    case 'c':
+                        config.maxCandidates = std::stoi(optarg);
+                        break;
+                    case 'C':
+                        config.maxCandidatesPerIP = std::stoi(optarg);
+                        break;
+                    case 'i':
+                        config.maxParked = std::stoull(optarg);
+                        break;
+                    case 'I':
+                        config.maxParkedPerIP = std::stoull(optarg);
+                        break;
+                    case 'L':
+                        config.lobby = true;
+                        break;
+                    case 'l':
+                        config.lobbyTimeout_ms = std::stoi(optarg) * time_ms_t{1000};
+                        break;
+                    case 'w':
+                        config.maxObservers = std::stoi(optarg);
+                        break;
+                    case 's':
+                        config.snapshotFilename = optarg;
+                        break;
+                    case 'H':
+                        config.handoffPath = optarg;
+                        break;
+                    case 'u':
+                        config.localSocketPath = optarg;
+                        break;
+                    case 'm':
+                        config.metricsPort = std::stoi(optarg);
+                        break;
+                    case 'T':
+                        config.traceFilename = optarg;
+                        break;
+                    case 'O':
+                        if (std::string(optarg) == "disconnect") {
+                            config.slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+                        } else if (std::string(optarg) == "pause") {
+                            config.slowConsumerPolicy = SlowConsumerPolicy::PauseTable;
+                        } else {
+                            throw std::invalid_argument("unknown slow consumer policy (expected disconnect or pause)");
+                        }
+                        break;
                     default:
                         Reporter::error("Invalid argument");
                         break;
                 }
             }
+            if (dealsFilename && config.seed) {
+                throw std::invalid_argument("-f and -g are mutually exclusive");
+            }
+            if (dealsFilename) {
+                config.deals = readDealsFromFile(*dealsFilename, config.verbose);
+            }
+            if (config.seed) {
+                config.deals = DealSource(DealGenerator(*config.seed, DealGenerator::parseRotation(rotation)));
+                Reporter::log("Generating endless deals with seed " + std::to_string(*config.seed) + " and deal types " + rotation + ".");
+            }
         }
         catch (std::invalid_argument& e) {
             Reporter::error("Argument error: " + std::string(e.what()));
@@ -86,7 +946,16 @@ public:
 
         // check if all required arguments are present
         if (config.deals.empty()) {
-            Reporter::logError("No deals provided. Usage: " + std::string(argv[0]) + " -f <filename> [-p <port>] [-t <timeout_seconds>]");
+            Reporter::logError("No deals provided. Usage: " + std::string(argv[0]) + " -f <filename> | -g <seed> [-d <deal types, e.g. 1234567>] [-p <port>] [-t <timeout_seconds>] [-v] [-r]\n"
+                              "          [-o <output high watermark bytes>] [-O disconnect|pause]\n"
+                              "          [-c <max candidates>] [-C <max candidates per IP>] [-i <max parked connections>]\n"
+                              "          [-I <max parked connections per IP>] [-L] [-l <lobby timeout seconds>]\n"
+                              "          [-R <robot takeover grace seconds>] [-w <max observers>] [-s <snapshot file>] [-H <handoff socket path>]\n"
+                              "          [-u <unix socket path>] [-m <metrics port>] [-T <trace file>]\n"
+                              "   or: " + std::string(argv[0]) + " --compile-deals <in.txt> <out.pack>\n"
+                              "   or: " + std::string(argv[0]) + " --check-deals <in.txt | in.pack>\n"
+                              "   or: " + std::string(argv[0]) + " --bench [max iterations]\n"
+                              "   or: " + std::string(argv[0]) + " --bench-idle [connections]");
             exit(1);
         }
 
@@ -94,6 +963,22 @@ public:
     }
 };
 
+// The seat taking a complete trick: the highest card of the suit led (the cards are in the order of play, from the
+// leader's one).
+Seat trickTaker(const std::vector<Card>& cardsOnTable, Seat leader) {
+    assert(cardsOnTable.size() == 4);
+    Seat taker = leader, seat = leader;
+    Card winningCard = cardsOnTable[0];
+    for (size_t i = 1; i < cardsOnTable.size(); ++i) {
+        seat = nextSeat(seat);
+        if (cardsOnTable[i].suit == cardsOnTable[0].suit && winningCard < cardsOnTable[i]) {
+            winningCard = cardsOnTable[i];
+            taker = seat;
+        }
+    }
+    return taker;
+}
+
 int countPoints(const std::vector<Card>& cards, DealType dealType, int trickNumber) {
     int points = 0;
     for (const auto& card: cards) {
@@ -139,16 +1024,377 @@ int countPoints(const std::vector<Card>& cards, DealType dealType, int trickNumb
 }
 
 
+// HDR-style histogram of durations in microseconds: the values below 16 are exact, the bigger ones fall into
+// 16 linear sub-buckets per power of two (so the relative error is below 1/16). It has fixed memory and O(1)
+// recording, so it can stay on all the time.
+class LatencyHistogram {
+    static constexpr int SubBuckets = 16;
+    std::array<uint64_t, SubBuckets * 61> counts{};
+    uint64_t total = 0, sum = 0, minValue = UINT64_MAX, maxValue = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SubBuckets) return value;
+        int shift = std::bit_width(value) - 5; // (value >> shift) has 5 significant bits: [16, 32)
+        return SubBuckets + shift * SubBuckets + ((value >> shift) - SubBuckets);
+    }
+    // the highest value that falls into the bucket
+    static uint64_t highestValueOf(size_t bucket) {
+        if (bucket < SubBuckets) return bucket;
+        size_t shift = (bucket - SubBuckets) / SubBuckets, sub = (bucket - SubBuckets) % SubBuckets;
+        return ((SubBuckets + sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(int64_t value_us) {
+        auto value = static_cast<uint64_t>(std::max<int64_t>(0, value_us));
+        counts[bucketOf(value)]++;
+        total++;
+        sum += value;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    [[nodiscard]] uint64_t percentile(double q) const {
+        auto rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(total)));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+            seen += counts[bucket];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return std::min(highestValueOf(bucket), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+    [[nodiscard]] uint64_t count() const { return total; }
+    [[nodiscard]] uint64_t sum_us() const { return sum; }
+
+    [[nodiscard]] std::string toString() const {
+        if (total == 0) return "-";
+        return "n=" + std::to_string(total) + " min=" + std::to_string(minValue) + " p50=" + std::to_string(percentile(0.5)) +
+               " p90=" + std::to_string(percentile(0.9)) + " p99=" + std::to_string(percentile(0.99)) +
+               " p99.9=" + std::to_string(percentile(0.999)) + " max=" + std::to_string(maxValue) +
+               " mean=" + std::to_string(sum / total) + " (us)";
+    }
+};
+
+// Connections parked while all the candidate slots are taken, in a compact form meant for a lot of them (a crowd
+// waiting for the seats): a 32-byte record indexed by the descriptor and an entry in an epoll set, which takes a
+// single pollfd slot of the server for all of them. There are no buffers nor per-connection logging - the input is
+// allocated only when a connection sends something, and it leaves (with the connection) when the connection gets a
+// candidate slot. The kernel keeps its own socket and epoll memory, which no representation can save.
+class IdleConnections {
+    struct Connection {
+        in6_addr ip{};
+        std::unique_ptr<std::string> input; // (only once something has been received)
+        uint32_t generation = 0; // of the descriptor (it outlives the connection, see readyQueue)
+        bool parked = false;
+        bool ready = false; // in the ready queue
+    };
+    struct QueuedFd {
+        int fd;
+        uint32_t generation;
+    };
+    struct IPHash {
+        size_t operator()(const in6_addr& ip) const {
+            return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(&ip), sizeof ip));
+        }
+    };
+    struct IPEqual {
+        bool operator()(const in6_addr& a, const in6_addr& b) const { return memcmp(&a, &b, sizeof a) == 0; }
+    };
+    // more than any IAM, a parked connection sending more than that is closed
+    static constexpr size_t MaxInputBytes = 512;
+
+    int epollFd = -1;
+    std::vector<Connection> byFd;
+    // connections with input, the oldest first; the entries of the ones closed since are dropped lazily (by the
+    // generation), all of them once nothing is ready and the rest when they outnumber the live ones
+    std::deque<QueuedFd> readyQueue;
+    std::vector<epoll_event> events;
+    size_t parkedCount = 0, readyCount = 0;
+    size_t maxParked, maxPerIP;
+    std::unordered_map<in6_addr, uint32_t, IPHash, IPEqual> parkedPerIP; // (only the IPs with a parked connection)
+
+    [[nodiscard]] bool _isLive(const QueuedFd& entry) const {
+        return byFd[entry.fd].ready && byFd[entry.fd].generation == entry.generation;
+    }
+
+    // forgets the connection (the descriptor is closed or handed out already)
+    void _remove(int fd) {
+        auto& connection = byFd[fd];
+        if (auto ip = parkedPerIP.find(connection.ip); --ip->second == 0) {
+            parkedPerIP.erase(ip);
+        }
+        readyCount -= connection.ready;
+        parkedCount--;
+        uint32_t generation = connection.generation;
+        connection = {}; // (frees the input)
+        connection.generation = generation;
+
+        if (readyCount == 0) {
+            readyQueue.clear();
+        } else if (readyQueue.size() > 2 * readyCount + 64) {
+            std::erase_if(readyQueue, [this](const QueuedFd& entry) { return !_isLive(entry); });
+        }
+    }
+
+    // reads until EAGAIN, returns false if the connection should be closed
+    bool _receive(int fd, Connection& connection) {
+        char buffer[MaxInputBytes];
+        while (true) {
+            ssize_t size = recv(fd, buffer, sizeof buffer, MSG_DONTWAIT);
+            if (size > 0) {
+                if (!connection.input) {
+                    connection.input = std::make_unique<std::string>();
+                }
+                connection.input->append(buffer, size);
+                if (connection.input->size() > MaxInputBytes) return false;
+                continue;
+            }
+            if (size == 0) return false; // hung up
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+    }
+
+    void _close(int fd) {
+        close(fd); // (leaves the epoll set as well)
+        _remove(fd);
+    }
+
+public:
+    struct Ready {
+        int fd;
+        in6_addr ip;
+        std::string input;
+    };
+
+    IdleConnections(size_t maxParked, size_t maxPerIP) : events(256), maxParked(maxParked), maxPerIP(maxPerIP) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            syserr("epoll_create1");
+        }
+    }
+    IdleConnections(const IdleConnections&) = delete;
+    IdleConnections& operator=(const IdleConnections&) = delete;
+    ~IdleConnections() {
+        closeAll();
+        close(epollFd);
+    }
+
+    // readable when some parked connection has sent something (or hung up)
+    [[nodiscard]] int fd() const { return epollFd; }
+    [[nodiscard]] size_t size() const { return parkedCount; }
+    [[nodiscard]] bool hasReady() const { return readyCount > 0; }
+    [[nodiscard]] static constexpr size_t recordBytes() { return sizeof(Connection); }
+
+    // Takes the connection over, returns false if there is no room for it, in total or for its IP (the caller still
+    // owns it then).
+    bool park(int fd, const in6_addr& ip) {
+        if (parkedCount >= maxParked) {
+            return false;
+        }
+        auto sameIP = parkedPerIP.find(ip);
+        if (sameIP != parkedPerIP.end() && sameIP->second >= maxPerIP) {
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            error("epoll_ctl");
+            return false;
+        }
+        if (byFd.size() <= static_cast<size_t>(fd)) {
+            byFd.resize(fd + 1);
+        }
+        auto& connection = byFd[fd];
+        connection = {.ip = ip, .input = nullptr, .generation = connection.generation + 1, .parked = true, .ready = false};
+        parkedCount++;
+        parkedPerIP[ip]++;
+        return true;
+    }
+
+    // Reads whatever the parked connections have sent (without blocking) and closes the ones that hung up.
+    void update() {
+        int count = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 0);
+        if (count < 0) {
+            if (errno == EINTR) return;
+            syserr("epoll_wait");
+        }
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            auto& connection = byFd[fd];
+            if (!_receive(fd, connection)) {
+                _close(fd);
+            }
+            else if (connection.input && !connection.ready) {
+                connection.ready = true;
+                readyCount++;
+                readyQueue.push_back({fd, connection.generation});
+            }
+        }
+    }
+
+    // Unparks the longest waiting connection that has sent something and whose IP 'admit' accepts, together with its
+    // input. The ones not admitted keep their place in the queue.
+    template<class Admit = bool (*)(const in6_addr&)>
+    std::optional<Ready> takeReady(Admit admit = [](const in6_addr&) { return true; }) {
+        for (auto entry = readyQueue.begin(); entry != readyQueue.end();) {
+            if (!_isLive(*entry)) {
+                entry = readyQueue.erase(entry); // (closed since, the descriptor may have been parked again)
+                continue;
+            }
+            if (!admit(byFd[entry->fd].ip)) {
+                ++entry;
+                continue;
+            }
+            int fd = entry->fd;
+            readyQueue.erase(entry);
+            auto& connection = byFd[fd];
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            Ready ready{fd, connection.ip, std::move(*connection.input)};
+            _remove(fd);
+            return ready;
+        }
+        return std::nullopt;
+    }
+
+    void closeAll() {
+        for (int fd = 0; fd < std::ssize(byFd); ++fd) {
+            if (byFd[fd].parked) {
+                _close(fd);
+            }
+        }
+        readyQueue.clear();
+    }
+};
+
+// Fixed-size pool of reusable objects addressed by stable handles (slot indices): a free list hands the slots out
+// and takes them back in O(1), a slot keeps whatever its object has allocated (e.g. buffers) for the next user,
+// and releasing one doesn't move the others, so the handles and the iteration stay valid.
+template<class T, size_t N>
+class SlotPool {
+    std::array<T, N> slots{};
+    std::array<bool, N> used{};
+    std::array<uint32_t, N> freeHandles{}; // stack, the lowest handle on top
+    size_t freeCount = N;
+
+    template<bool Const>
+    class Iterator {
+        using Pool = std::conditional_t<Const, const SlotPool, SlotPool>;
+        Pool* pool;
+        size_t index;
+        void _skipFree() {
+            while (index < N && !pool->used[index]) ++index;
+        }
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const T*, T*>;
+        using reference = std::conditional_t<Const, const T&, T&>;
+
+        Iterator(Pool* pool, size_t index) : pool(pool), index(index) { _skipFree(); }
+        reference operator*() const { return pool->slots[index]; }
+        pointer operator->() const { return &pool->slots[index]; }
+        Iterator& operator++() { ++index; _skipFree(); return *this; }
+        Iterator operator++(int) { Iterator old = *this; ++*this; return old; }
+        bool operator==(const Iterator& other) const { return index == other.index; }
+        [[nodiscard]] uint32_t handle() const { return static_cast<uint32_t>(index); }
+    };
+
+public:
+    using Handle = uint32_t;
+
+    SlotPool() {
+        for (size_t i = 0; i < N; ++i) freeHandles[i] = static_cast<Handle>(N - 1 - i);
+    }
+
+    std::optional<Handle> acquire() {
+        if (freeCount == 0) return std::nullopt;
+        Handle handle = freeHandles[--freeCount];
+        used[handle] = true;
+        return handle;
+    }
+    void release(Handle handle) {
+        assert(used[handle]);
+        used[handle] = false;
+        freeHandles[freeCount++] = handle;
+    }
+
+    T& operator[](Handle handle) { assert(used[handle]); return slots[handle]; }
+    [[nodiscard]] bool contains(Handle handle) const { return used[handle]; }
+    [[nodiscard]] Handle handleOf(const T& object) const { return static_cast<Handle>(&object - slots.data()); }
+    [[nodiscard]] size_t size() const { return N - freeCount; }
+    // all the slots, free ones included (e.g. to preallocate their resources)
+    std::array<T, N>& allSlots() { return slots; }
+
+    // iteration over the used slots (releasing the current one is fine)
+    Iterator<false> begin() { return {this, 0}; }
+    Iterator<false> end() { return {this, N}; }
+    Iterator<true> begin() const { return {this, 0}; }
+    Iterator<true> end() const { return {this, N}; }
+};
+
 class Server {
 private:
     ServerConfig config;
+    std::unique_ptr<TableSnapshot> snapshot; // (if enabled)
+    int handoffPeer = -1; // the successor waiting for the table (see Handoff)
+    int reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC); // (see _shedConnection)
+
+    // Latency metrics (always on), dumped to the log on SIGUSR1 and at the end of each game.
+    struct Metrics {
+        std::array<LatencyHistogram, 4> turn; // TRICK sent -> TRICK received (by seatIndex)
+        LatencyHistogram parse; // parsing of a received message
+        LatencyHistogram step; // one call of the state function
+        LatencyHistogram pollWait, pollBusy; // time spent in poll vs between the polls
+        int64_t lastPollEnd_us = 0;
+        // global heap allocations during the last finished deal (see AllocationCounter)
+        uint64_t dealStartAllocations = 0, dealStartBytes = 0;
+        uint64_t lastDealAllocations = 0, lastDealBytes = 0;
+
+        [[nodiscard]] std::string toString() const {
+            std::string result = "Latency metrics:";
+            for (int seat = 0; seat < 4; ++seat) {
+                result += "\n  turn " + ::seatToString(seatFromIndex(seat)) + ":   " + turn[seat].toString();
+            }
+            result += "\n  parse:    " + parse.toString();
+            result += "\n  step:     " + step.toString();
+            result += "\n  poll wait: " + pollWait.toString();
+            result += "\n  poll busy: " + pollBusy.toString();
+            result += "\n  heap allocations in the last deal: " + std::to_string(lastDealAllocations) + " (" + std::to_string(lastDealBytes) + " bytes)";
+            return result;
+        }
+    } metrics;
+    static inline volatile sig_atomic_t metricsDumpRequested = 0;
+
+    // Events of the table (the messages are counted by the PollBuffers, see MessageCounters).
+    struct EventCounters : ShardedCounters<EventCounters, 5> {
+        enum { TrickTimeouts, CandidateTimeouts, Reconnects, Disconnections, RejectedConnections };
+    };
+
+    std::shared_ptr<Msg> _parse(const std::string& raw, bool binary) {
+        int64_t start_us = time_us();
+        auto msg = Parser::parse(raw, binary);
+        metrics.parse.record(time_us() - start_us);
+        return msg;
+    }
 
     struct Polling {
-        static constexpr int Connections = 8;
+        static constexpr int Connections = 12;
         // initialize the pollfd array with values {.fd = -1, .events = 0, .revents = 0}
         // std::array<struct pollfd, Connections> fds = {{.fd = -1, .events = 0, .revents = 0 }};
         pollfd fds[Connections]{};
         const int fdAcceptIdx = 0;
+        const int fdHandoffIdx = 1; // (see Handoff, free for the candidates if disabled)
+        const int fdLocalAcceptIdx = 2; // AF_UNIX listener for the co-located clients (free for the candidates if disabled)
+        bool localAccepting = false; // whether the slot above holds the AF_UNIX listener
+        const int fdMetricsIdx = 3; // HTTP listener for the metrics scrapes (free for the candidates if disabled)
+        const int fdIdleIdx = 4; // epoll set of the parked connections (free for the candidates if disabled)
+        static constexpr int ReservedSlots = 5; // (the ones above)
+        std::unique_ptr<IdleConnections> idle; // the parked connections (if enabled)
         Polling() {
             // for (auto& fd: fds) {
             for (auto & fd : fds) {
@@ -156,25 +1402,46 @@ private:
                 fd.events = 0;
                 fd.revents = 0;
             }
+            for (auto& candidate: candidates.allSlots()) {
+                candidate.buffer.reserve(PreallocatedBufferBytes);
+            }
         }
         struct Candidate {
             PollBuffer buffer{};
             enum State {
                 WaitingForIAM,
                 Rejecting,
-            } state;
+                Scrape, // a metrics request (HTTP), answered and closed
+                Queued, // in the lobby, waiting for any free seat (without a timeout)
+            } state = WaitingForIAM;
             time_ms_t connectionTime_ms{};
-
-            explicit Candidate(PollBuffer buffer, State state = State::WaitingForIAM)
-                    : buffer(std::move(buffer)), state(state), connectionTime_ms(time_ms()) {}
-
-            explicit Candidate(struct pollfd* pollfd): Candidate(PollBuffer(pollfd)) {}
+            in6_addr ip{}; // for the per-IP admission limit (IPv4 clients are IPv4-mapped)
+            uint64_t lobbyTicket = 0; // (while Queued, see Lobby)
+
+            // (re)uses the pooled candidate for a new connection (the buffer keeps its memory)
+            void start(struct pollfd* pollfd, State initialState, const in6_addr& address) {
+                // (a scrape reads the whole HTTP request header as one message)
+                if (initialState == State::Scrape) {
+                    buffer.connect(pollfd, false, "\r\n\r\n");
+                    buffer.setCounted(false);
+                } else {
+                    buffer.connect(pollfd);
+                }
+                state = initialState;
+                connectionTime_ms = time_ms();
+                ip = address;
+                lobbyTicket = 0;
+            }
         };
 
-        std::vector<Candidate> candidates{}; // in/out buffer wrappers for candidate players (without a seat yet)
+        // in/out buffer wrappers for candidate players (without a seat yet); every candidate holds a pollfd slot, so
+        // there can't be more of them than the slots
+        static constexpr size_t PreallocatedBufferBytes = 512;
+        SlotPool<Candidate, Connections> candidates;
 
         void startAccepting(int port) {
-            fds[fdAcceptIdx].fd = socket(AF_INET6, SOCK_STREAM, 0);
+            // non-blocking, so that the pending connections can be accepted in batches until EAGAIN
+            fds[fdAcceptIdx].fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
             if (fds[fdAcceptIdx].fd < 0) {
                 syserr("cannot create a socket");
             }
@@ -193,7 +1460,7 @@ private:
                 syserr("bind");
             }
 
-            const int QueueLength = 4;
+            const int QueueLength = 64; // connection storms are drained (and mostly rejected) in batches
             if (listen(fds[fdAcceptIdx].fd, QueueLength) < 0) {
                 syserr("listen");
             }
@@ -208,81 +1475,439 @@ private:
             fds[fdAcceptIdx].revents = 0;
         }
 
+        // The same protocol over a Unix domain socket: the local clients skip the whole TCP/IP stack.
+        void startAcceptingLocal(const std::string& path) {
+            fds[fdLocalAcceptIdx].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fds[fdLocalAcceptIdx].fd < 0) {
+                syserr("cannot create a socket");
+            }
+
+            struct sockaddr_un server_address{};
+            if (path.size() >= sizeof(server_address.sun_path)) {
+                fatal("Unix socket path is too long: %s", path.c_str());
+            }
+            server_address.sun_family = AF_UNIX;
+            memcpy(server_address.sun_path, path.c_str(), path.size() + 1);
+            unlink(path.c_str()); // (left by a previous server)
+            if (bind(fds[fdLocalAcceptIdx].fd, (struct sockaddr *) &server_address, (socklen_t) sizeof server_address) < 0) {
+                syserr("bind %s", path.c_str());
+            }
+
+            const int QueueLength = 64;
+            if (listen(fds[fdLocalAcceptIdx].fd, QueueLength) < 0) {
+                syserr("listen");
+            }
+            Reporter::debug(Color::Green, "Server is listening on the Unix socket " + path);
+
+            fds[fdLocalAcceptIdx].events = POLLIN;
+            fds[fdLocalAcceptIdx].revents = 0;
+            localAccepting = true;
+        }
+
+        // Plain HTTP on the loopback interface: every request gets the metrics (see _prometheusMetrics).
+        void startMetrics(int port) {
+            fds[fdMetricsIdx].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fds[fdMetricsIdx].fd < 0) {
+                syserr("cannot create a socket");
+            }
+
+            // (SO_REUSEADDR for a restart while old connections linger, SO_REUSEPORT lets a successor bind it before
+            // this server exits, see Handoff)
+            int optval = 1;
+            if (setsockopt(fds[fdMetricsIdx].fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) < 0) {
+                syserr("setsockopt SO_REUSEADDR");
+            }
+            if (setsockopt(fds[fdMetricsIdx].fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval) < 0) {
+                syserr("setsockopt SO_REUSEPORT");
+            }
+
+            struct sockaddr_in server_address{};
+            server_address.sin_family = AF_INET;
+            server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            server_address.sin_port = htons(port);
+            if (bind(fds[fdMetricsIdx].fd, (struct sockaddr *) &server_address, (socklen_t) sizeof server_address) < 0) {
+                syserr("bind metrics port %d", port);
+            }
+
+            const int QueueLength = 8;
+            if (listen(fds[fdMetricsIdx].fd, QueueLength) < 0) {
+                syserr("listen");
+            }
+
+            auto length = (socklen_t) sizeof server_address;
+            if (getsockname(fds[fdMetricsIdx].fd, (struct sockaddr *) &server_address, &length) < 0) {
+                syserr("getsockname");
+            }
+            Reporter::debug(Color::Green, "Metrics are served on 127.0.0.1:" + std::to_string(ntohs(server_address.sin_port)));
+
+            fds[fdMetricsIdx].events = POLLIN;
+            fds[fdMetricsIdx].revents = 0;
+        }
+
+        void startParking(size_t maxParked, size_t maxPerIP) {
+            idle = std::make_unique<IdleConnections>(maxParked, maxPerIP);
+            fds[fdIdleIdx] = {.fd = idle->fd(), .events = POLLIN, .revents = 0};
+        }
+
         void pauseAccepting() {
             fds[fdAcceptIdx].events = 0;
+            if (localAccepting)
+                fds[fdLocalAcceptIdx].events = 0;
         }
 
         void resumeAccepting() {
             fds[fdAcceptIdx].events = POLLIN;
+            if (localAccepting)
+                fds[fdLocalAcceptIdx].events = POLLIN;
         }
 
         void stopAccepting() {
             close(fds[fdAcceptIdx].fd);
             fds[fdAcceptIdx].fd = -1;
+            if (localAccepting) {
+                close(fds[fdLocalAcceptIdx].fd);
+                fds[fdLocalAcceptIdx].fd = -1;
+                localAccepting = false;
+            }
+            if (idle) {
+                idle->closeAll();
+            }
         }
     } poll;
 
-    std::vector<Seat> getTakenSeats() {
-        std::vector<Seat> takenSeats;
+    // The players who asked for any seat (IAM*, with -L), in the order of arrival. They wait as candidates (holding
+    // their slots, so the newer connections park, see IdleConnections) and take the free seats one at a time, the
+    // longest waiting first. A queued candidate that leaves keeps its entry until _updateLobby drops it.
+    struct Lobby {
+        struct Entry {
+            SlotPool<Polling::Candidate, Polling::Connections>::Handle handle;
+            uint64_t ticket;
+        };
+        std::deque<Entry> queue;
+        uint64_t nextTicket = 1;
+    } lobby;
+
+    // Read-only spectators of the table. They share one feed of serialized messages (DEAL without the hand, TAKEN,
+    // SCORE, TOTAL): a message is appended to the feed once and every observer only keeps its offset in it, so the
+    // fan-out costs no formatting nor copying per observer. The observers are not in the players' poll set - their
+    // input and hangups come through an epoll set, and they are written (without blocking) only when the feed has
+    // grown or a slow one has become writable again, so an idle wake-up of the players' loop costs one epoll_wait
+    // however many observers there are. The leftovers of slow observers wait for EPOLLOUT.
+    struct Observers {
+        struct Observer {
+            int fd;
+            size_t sent; // offset of the first unsent byte in the feed
+            bool blocked = false; // waiting for EPOLLOUT (the socket buffer is full)
+        };
+        std::vector<Observer> list;
+        std::vector<uint32_t> indexByFd; // (of the list, rebuilt when some observers are dropped)
+        int epollFd = -1;
+        std::vector<epoll_event> events = std::vector<epoll_event>(256);
+        bool fresh = false; // the feed has grown (or an observer has joined) since the last flush
+        std::string feed;
+        std::vector<std::pair<size_t, MessageCounters::Type>> messages; // end offset in the feed and type of its messages
+        size_t dealStart = 0; // offset of the current deal in the feed (a new observer starts watching there)
+        size_t maxQueued = SIZE_MAX; // an observer with more unsent bytes is dropped (he may reconnect)
+
+        [[nodiscard]] size_t size() const { return list.size(); }
+
+        void add(int fd) {
+            if (epollFd < 0 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                syserr("epoll_create1");
+            }
+            _watch(EPOLL_CTL_ADD, fd, false);
+            if (indexByFd.size() <= static_cast<size_t>(fd)) {
+                indexByFd.resize(fd + 1);
+            }
+            indexByFd[fd] = static_cast<uint32_t>(list.size());
+            list.push_back({fd, dealStart});
+            fresh = fresh || dealStart < feed.size();
+        }
+
+        // (the message may be several lines, e.g. the TAKEN history)
+        void publish(std::string_view message) {
+            for (size_t start = 0, end; (end = message.find("\r\n", start)) != std::string_view::npos; start = end + 2) {
+                messages.emplace_back(feed.size() + end + 2, MessageCounters::typeOf(std::string(message.substr(start, 2))));
+            }
+            feed += message;
+            fresh = true;
+        }
+
+        // Called before the DEAL of a new deal is published: drops the part of the feed that every observer has got.
+        void startDeal() {
+            size_t consumed = feed.size();
+            for (const auto& observer: list) {
+                consumed = std::min(consumed, observer.sent);
+            }
+            feed.erase(0, consumed);
+            for (auto& observer: list) {
+                observer.sent -= consumed;
+            }
+            std::erase_if(messages, [consumed](const auto& m) { return m.first <= consumed; });
+            for (auto& m: messages) {
+                m.first -= consumed;
+            }
+            dealStart = feed.size();
+        }
+
+        [[nodiscard]] bool isWriting() const {
+            return std::any_of(list.begin(), list.end(), [this](const auto& o) { return o.sent < feed.size(); });
+        }
+
+        [[nodiscard]] size_t queuedBytes() const {
+            size_t queued = 0;
+            for (const auto& observer: list) {
+                queued += feed.size() - observer.sent;
+            }
+            return queued;
+        }
+
+        // Counts the messages of the fan-out completed by sending the feed's bytes [from, to) as outgoing ones.
+        void _countSent(size_t from, size_t to) const {
+            auto it = std::upper_bound(messages.begin(), messages.end(), from, [](size_t offset, const auto& m) { return offset < m.first; });
+            for (; it != messages.end() && it->first <= to; ++it) {
+                MessageCounters::add(MessageCounters::index(false, it->second));
+            }
+        }
+
+        void _watch(int operation, int fd, bool writable) const {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            if (writable) {
+                event.events |= EPOLLOUT;
+            }
+            event.data.fd = fd;
+            if (epoll_ctl(epollFd, operation, fd, &event) < 0) {
+                syserr("epoll_ctl (observer)");
+            }
+        }
+
+        // Sends what the observer is missing, returns false if he should be dropped.
+        bool _send(Observer& observer) {
+            ssize_t size = send(observer.fd, feed.data() + observer.sent, feed.size() - observer.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (size > 0) {
+                _countSent(observer.sent, observer.sent + size);
+                observer.sent += size;
+            }
+            if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            bool blocked = observer.sent < feed.size();
+            if (blocked != observer.blocked) {
+                observer.blocked = blocked;
+                _watch(EPOLL_CTL_MOD, observer.fd, blocked);
+            }
+            return true;
+        }
+
+        // Handles the observers' input (discarded) and hangups, sends the new part of the feed to every observer and
+        // the rest to the slow ones that can take it, drops the disconnected and the too slow ones.
+        void flush() {
+            if (list.empty()) return;
+            int count = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 0);
+            if (count < 0) {
+                if (errno != EINTR) syserr("epoll_wait (observers)");
+                count = 0;
+            }
+
+            size_t dropped = 0;
+            auto drop = [&dropped](Observer& observer) {
+                close(observer.fd); // (leaves the epoll set as well)
+                observer.fd = -1;
+                dropped++;
+            };
+            for (int i = 0; i < count; ++i) {
+                auto& observer = list[indexByFd[events[i].data.fd]];
+                bool hungUp = events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+                if (!hungUp && (events[i].events & EPOLLIN)) {
+                    char ignored[256];
+                    ssize_t size = read(observer.fd, ignored, sizeof ignored);
+                    hungUp = size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+                }
+                if (hungUp || ((events[i].events & EPOLLOUT) && !_send(observer))) {
+                    drop(observer);
+                }
+            }
+            if (fresh) {
+                fresh = false;
+                for (auto& observer: list) {
+                    if (observer.fd == -1) continue;
+                    if (feed.size() - observer.sent > maxQueued || (!observer.blocked && observer.sent < feed.size() && !_send(observer))) {
+                        drop(observer);
+                    }
+                }
+            }
+            if (dropped > 0) {
+                std::erase_if(list, [](const auto& observer) { return observer.fd == -1; });
+                for (size_t i = 0; i < list.size(); ++i) {
+                    indexByFd[list[i].fd] = static_cast<uint32_t>(i);
+                }
+                Reporter::debug(Color::Red, "Dropped " + std::to_string(dropped) + " observer(s).");
+            }
+        }
+
+        // Flushes the rest of the feed until the deadline and disconnects all the observers.
+        void closeAll(time_ms_t deadline_ms) {
+            flush();
+            while (isWriting() && time_ms() < deadline_ms) {
+                // (only the blocked ones are left, wait until some can take more)
+                if (epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), static_cast<int>(deadline_ms - time_ms())) < 0 && errno != EINTR) {
+                    syserr("epoll_wait (observers)");
+                }
+                flush();
+            }
+            for (const auto& observer: list) {
+                close(observer.fd);
+            }
+            list.clear();
+        }
+    } observers;
+
+    // BUSY messages precomputed for every set of taken seats (indexed by the bitmask of seatIndex), so that
+    // rejecting a connection doesn't cost any formatting. There is no message for the empty set (it's not valid).
+    const std::array<WireMessage, 16> busyMessages = [] {
+        std::array<WireMessage, 16> messages;
+        for (int mask = 1; mask < 16; ++mask) {
+            std::vector<Seat> seats;
+            for (int seat = 0; seat < 4; ++seat) {
+                if (mask & (1 << seat)) seats.push_back(seatFromIndex(seat));
+            }
+            messages[mask] = WireMessage(Busy(seats));
+        }
+        return messages;
+    }();
+
+    int takenSeatsMask() const {
+        int mask = 0;
         for (const auto &[seat, player]: players) {
             if (player.buffer.isConnected())
-                takenSeats.push_back(seat);
+                mask |= 1 << seatIndex(seat);
         }
-        return takenSeats;
+        return mask;
     }
 
     struct Player {
         PollBuffer buffer;
         time_t trickRequestTime_ms{};
+        int64_t trickRequestTime_us{}; // (monotonic, for the metrics)
+        time_ms_t disconnectionTime_ms{};
+        bool robot = false; // the seat is played by the server (see ServerConfig::robotGrace_ms)
         Seat seat{};
         PlayerStats stats;
 
-        Player(Seat seat, PollBuffer buffer) : buffer(std::move(buffer)), seat(seat) {}
+        Player(Seat seat, PollBuffer buffer, std::pmr::memory_resource* arena) : buffer(std::move(buffer)), seat(seat), stats(arena) {}
 
         [[nodiscard]] bool isConnected() const {
             return buffer.isConnected();
         }
 
-        void connect(PollBuffer new_buffer) {
-            this->buffer = std::move(new_buffer);
+        // the seat takes part in the game (either a connected human or a robot)
+        [[nodiscard]] bool isActive() const {
+            return isConnected() || robot;
+        }
+
+        // sends the message (in the encoding of the player) if there is someone to receive it
+        void send(const WireMessage& message) {
+            if (isConnected()) buffer.writeMessage(message);
+        }
+        void send(const Msg& message) {
+            if (isConnected()) buffer.writeMessage(message);
         }
 
-        void disconnect() {
+        // Takes over the connection of 'new_buffer', which gets the previous (disconnected) buffer of the player in
+        // exchange - so that the pooled buffers keep circulating instead of being reallocated.
+        void connect(PollBuffer& new_buffer) {
+            std::swap(buffer, new_buffer);
+        }
+
+        // Every disconnection starts the robot grace period (see ServerConfig::robotGrace_ms), and the trick request
+        // time is reset so that when he reconnects he will immediately get the TRICK message as if he timeout'ed.
+        void disconnect(time_ms_t timeout_ms) {
             buffer.disconnect();
+            trickRequestTime_ms = time_ms() - timeout_ms;
+            disconnectionTime_ms = time_ms();
         }
     };
 
-    std::unordered_map<Seat, Player> players{
-            {Seat::N, Player(Seat::N, PollBuffer())},
-            {Seat::E, Player(Seat::E, PollBuffer())},
-            {Seat::S, Player(Seat::S, PollBuffer())},
-            {Seat::W, Player(Seat::W, PollBuffer())}
-    }; // in/out buffer wrappers for players (with a seat)
+    // The dynamic state of the table (hands, taken tricks, history) comes from its own pool, so these containers recycle
+    // that memory instead of going to the global heap; it's all released at once at the end of each game. The rest of
+    // the loop still allocates (the shared messages, report lines, the state closures) - see the per-deal count in
+    // Metrics::lastDealAllocations.
+    std::pmr::unsynchronized_pool_resource tableArena;
+
+    // (emplaced, so that the players' containers keep the arena - a copy would get the default resource)
+    std::unordered_map<Seat, Player> players = [this] {
+        std::unordered_map<Seat, Player> map;
+        for (Seat seat: {Seat::N, Seat::E, Seat::S, Seat::W}) {
+            map.try_emplace(seat, seat, PollBuffer(), &tableArena);
+        }
+        return map;
+    }(); // in/out buffer wrappers for players (with a seat)
 
     bool allPlayersConnected() {
         return std::all_of(players.begin(), players.end(), [](const auto &p) { return p.second.isConnected(); });
     }
 
+    // The game can go on: every seat is played by a human or a robot (but the robots don't play alone).
+    bool allSeatsActive() const {
+        return std::all_of(players.begin(), players.end(), [](const auto &p) { return p.second.isActive(); }) &&
+               std::any_of(players.begin(), players.end(), [](const auto &p) { return p.second.isConnected(); });
+    }
+
+    // Hands the seats of the players who have been disconnected for longer than the grace period over to robots.
+    void _updateRobotTakeovers() {
+        if (!config.robotGrace_ms || !game.byl_pierwszy_deal) return;
+        for (auto& [seat, player]: players) {
+            if (!player.isActive() && time_ms() - player.disconnectionTime_ms >= *config.robotGrace_ms) {
+                player.robot = true;
+                Reporter::log(Color::Yellow, "Robot takes over the seat " + ::seatToString(seat) + ".");
+            }
+        }
+    }
+
+    // A reconnected human gets his seat back (called at trick boundaries).
+    void _handBackRobotSeats() {
+        for (auto& [seat, player]: players) {
+            if (player.robot && player.isConnected()) {
+                player.robot = false;
+                Reporter::log(Color::Yellow, "Player " + ::seatToString(seat) + " takes his seat back from the robot.");
+            }
+        }
+    }
+
 private:
     time_ms_t _pollGetSensibleTimeout_ms() {
         // enumerate over all connected candidates and the current player to find the smallest (but positive) timeout
         auto timeout_ms = config.timeout_ms();
-        auto minimize_with_timeout_from = [&timeout_ms, this](time_ms_t start_time_ms) {
-            timeout_ms = std::min(timeout_ms, (start_time_ms + config.timeout_ms()) - time_ms());
-            //                                 ^^^^^^^^ how many ms left until timeout ^^^^^^^^^
+        auto minimize_with_timeout_from = [&timeout_ms, this](time_ms_t start_time_ms, time_ms_t duration_ms) {
+            timeout_ms = std::min(timeout_ms, (start_time_ms + duration_ms) - time_ms());
+            //                                 ^^^^^^ how many ms left until timeout ^^^^^^^
         };
 
         // adjust the timeout, there are 2 cases:
-        // 1) all players are connected and the current player may have timeout
-        // 2) not all players are connected and the candidates may have timeout
-
-        if (allPlayersConnected() && game.currentPlayer) {
-            minimize_with_timeout_from(game.currentPlayer->trickRequestTime_ms);
+        // 1) all seats are active and the current player may have timeout
+        // 2) not all seats are active and the candidates may have timeout (or the robots may take over)
+        // (while the table is paused, neither the TRICK deadline nor a buffered TRICK can be acted upon - the poll
+        // waits for the congested players' POLLOUT, with the trick timeout as the longest wait)
+
+        if (allSeatsActive() && game.currentPlayer && !_isTablePausedByBackpressure()) {
+            if (game.currentPlayer->buffer.hasMessage()) {
+                return 0; // (already received, e.g. handed off with the socket)
+            }
+            minimize_with_timeout_from(game.currentPlayer->trickRequestTime_ms, config.timeout_ms());
         }
-        else if (!allPlayersConnected()) {
+        else if (!allSeatsActive()) {
             for (auto& candidate : poll.candidates) {
                 if (candidate.buffer.isConnected()) {
-                    minimize_with_timeout_from(candidate.connectionTime_ms);
+                    bool queued = candidate.state == Polling::Candidate::State::Queued;
+                    minimize_with_timeout_from(candidate.connectionTime_ms, queued ? config.lobbyTimeout_ms : config.timeout_ms());
+                }
+            }
+            if (config.robotGrace_ms && game.byl_pierwszy_deal) {
+                for (auto& [seat, player]: players) {
+                    if (!player.isActive()) {
+                        minimize_with_timeout_from(player.disconnectionTime_ms, *config.robotGrace_ms);
+                    }
                 }
             }
         }
@@ -299,96 +1924,270 @@ private:
         Reporter::debug(Color::Yellow, "Polling with timeout: " + std::to_string(timeout_ms) + " ms.");
 
         time_ms_t poll_start_time_ms = time_ms();
-        int fds_with_events = ::poll(poll.fds, Polling::Connections, timeout_ms);
-        if (fds_with_events < 0) { syserr("poll"); }
+        int64_t poll_start_us = time_us();
+        if (metrics.lastPollEnd_us != 0) {
+            metrics.pollBusy.record(poll_start_us - metrics.lastPollEnd_us);
+        }
+        int fds_with_events;
+        {
+            Tracer::Scope trace("poll");
+            fds_with_events = ::poll(poll.fds, Polling::Connections, timeout_ms);
+            if (fds_with_events < 0) {
+                if (errno != EINTR) { syserr("poll"); }
+                fds_with_events = 0; // (interrupted by a signal, e.g. SIGUSR1)
+            }
+            if (Tracer::isEnabled()) {
+                trace.args = "{\"timeout_ms\":" + std::to_string(timeout_ms) + ",\"events\":" + std::to_string(fds_with_events) + "}";
+            }
+        }
         time_ms_t poll_end_time_ms = time_ms();
+        metrics.lastPollEnd_us = time_us();
+        metrics.pollWait.record(metrics.lastPollEnd_us - poll_start_us);
+
+        if (metricsDumpRequested) {
+            metricsDumpRequested = 0;
+            Reporter::log(Color::Cyan, metrics.toString());
+            Tracer::flush();
+        }
 
         for (auto &[seat, player]: players) {
             if (player.buffer.isConnected())
                 player.buffer.update();
         }
-        for (auto &candidate: poll.candidates) {
-            candidate.buffer.update();
+        for (auto candidate = poll.candidates.begin(); candidate != poll.candidates.end(); ++candidate) {
+            candidate->buffer.update();
+            // a queued player has nothing to say until he is seated, so his input is never buffered beyond one read
+            // (checked here, as the lobby is not processed during the game)
+            if (candidate->state == Polling::Candidate::State::Queued && candidate->buffer.hasInput()) {
+                candidate->buffer.disconnect();
+                Reporter::debug(Color::Red, "Queued candidate disconnected due to an unexpected message.");
+                poll.candidates.release(candidate.handle());
+            }
+        }
+        // (drained at every wake-up, the parked input would keep the poll readable otherwise)
+        if (poll.idle && (poll.fds[poll.fdIdleIdx].revents & POLLIN)) {
+            poll.idle->update();
         }
 
         Reporter::debug(Color::Magenta, "[" + std::to_string(poll_end_time_ms - poll_start_time_ms)
-            + "ms] Poll returned: " + std::to_string(fds_with_events) + " fds events and updated buffers.");
+            + "ms] Poll returned: " + std::to_string(fds_with_events) + " fds events and updated buffers ("
+            + std::to_string(_queuedBytes()) + " bytes queued).");
+    }
+
+    // total size of the unsent output of the players
+    size_t _queuedBytes() const {
+        size_t queued = 0;
+        for (const auto& [seat, player]: players) {
+            queued += player.buffer.queuedBytes();
+        }
+        return queued;
+    }
+
+    // With the PauseTable policy, the game waits (polling) until no player is congested.
+    bool _isTablePausedByBackpressure() const {
+        return config.slowConsumerPolicy == ServerConfig::SlowConsumerPolicy::PauseTable &&
+               std::any_of(players.begin(), players.end(), [](const auto& p) { return p.second.buffer.isCongested(); });
     }
 
     void _updateDisconnections() {
         // (1) updateBuffers disconnections and remove disconnected players or candidates
         for (auto &[seat, player]: players) {
             if (player.isConnected()) {
-                if (player.buffer.hasError()) {
-                    // disconnect the player
-                    player.buffer.disconnect();
-
-                    // reset the trick request time so that when player reconnects he will immediately get the TRICK message as if he timeout'ed
-                    player.trickRequestTime_ms = time_ms() - config.timeout_ms();
-
+                bool tooSlow = player.buffer.isCongested() && config.slowConsumerPolicy == ServerConfig::SlowConsumerPolicy::Disconnect;
+                if (player.buffer.hasError() || tooSlow) {
+                    if (tooSlow) {
+                        Reporter::logWarning("Player " + ::seatToString(seat) + " does not read his messages (" +
+                                             std::to_string(player.buffer.queuedBytes()) + " bytes queued).");
+                    }
+                    player.disconnect(config.timeout_ms());
+
+                    EventCounters::add(EventCounters::Disconnections);
                     Reporter::log(Color::Red, "Player " + ::seatToString(seat) + " disconnected.");
                 }
             }
         }
 
-        for (auto candidate = poll.candidates.begin(); candidate != poll.candidates.end(); /*candidate++*/) {
-            if (candidate->buffer.hasError()) {
+        for (auto candidate = poll.candidates.begin(); candidate != poll.candidates.end(); ++candidate) {
+            if (candidate->buffer.hasError() || candidate->buffer.isCongested()) {
                 // disconnect the candidate
                 candidate->buffer.disconnect();
                 Reporter::debug(Color::Red, "Candidate disconnected due to error.");
-                // remove the candidate
-                candidate = poll.candidates.erase(candidate); // iteration still valid: https://en.cppreference.com/w/cpp/container/unordered_map/erase
-            } else {
-                candidate++;
+                // return the candidate to the pool (the iteration stays valid)
+                poll.candidates.release(candidate.handle());
             }
         }
     }
 
+    // Out of descriptors, the pending connection can't even be accepted - and the listener stays readable, so the
+    // server would spin. The reserve descriptor makes room for accepting it just to close it at once.
+    bool _shedConnection(int listenerIdx) {
+        close(reserveFd);
+        int client_fd = accept4(poll.fds[listenerIdx].fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd >= 0) {
+            EventCounters::add(EventCounters::RejectedConnections);
+            close(client_fd);
+        }
+        reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return client_fd >= 0;
+    }
+
+    // Cheap rejection of a connection that is not admitted (no buffers, no reporting): best-effort BUSY and close.
+    void _rejectConnection(int client_fd) {
+        EventCounters::add(EventCounters::RejectedConnections);
+        const std::string& busy = busyMessages[takenSeatsMask()].text; // (nothing has been negotiated yet)
+        if (!busy.empty()) {
+            send(client_fd, busy.data(), busy.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        close(client_fd);
+    }
+
+    [[nodiscard]] int _maxCandidates() const {
+        return config.maxCandidates.value_or(Polling::Connections - Polling::ReservedSlots);
+    }
+
+    bool _admitConnection(const in6_addr& ip) const {
+        auto sameIP = std::count_if(poll.candidates.begin(), poll.candidates.end(), [&ip](const auto& candidate) {
+            return memcmp(&candidate.ip, &ip, sizeof ip) == 0;
+        });
+        // (not -c by default: a lowered total limit shouldn't make a single host's overflow rejected instead of parked)
+        return sameIP < config.maxCandidatesPerIP.value_or(Polling::Connections - Polling::ReservedSlots);
+    }
+
+    // the first pollfd slot free for a new candidate (if the candidate limit allows one, the scrapes are not limited)
+    pollfd* _freeCandidateSlot(bool limited = true) {
+        if (limited && std::ssize(poll.candidates) >= _maxCandidates()) {
+            return nullptr;
+        }
+        auto pollfd = std::find_if(std::begin(poll.fds), std::end(poll.fds), [](const auto& fd) { return fd.fd == -1; });
+        return pollfd == std::end(poll.fds) ? nullptr : &*pollfd;
+    }
+
+    SlotPool<Polling::Candidate, Polling::Connections>::Handle _startCandidate(pollfd* pollfd, int client_fd, Polling::Candidate::State state, const in6_addr& ip) {
+        pollfd->fd = client_fd;
+        pollfd->events = POLLIN;
+
+        auto handle = poll.candidates.acquire();
+        assert(handle && "there are more pooled candidates than the pollfd slots");
+        auto& candidate = poll.candidates[*handle];
+        candidate.start(pollfd, state, ip);
+        // (a metrics response is written whole and can exceed the players' watermark, so a scrape is never congested)
+        if (state == Polling::Candidate::State::Scrape) {
+            candidate.buffer.setWatermarks(SIZE_MAX, 0);
+        } else {
+            candidate.buffer.setWatermarks(config.outputHighWatermark, config.outputLowWatermark());
+        }
+        return *handle;
+    }
+
     void _updateNewConnections() {
-        if (poll.fds[poll.fdAcceptIdx].revents & POLLIN) {
-            struct sockaddr_in client_address{};
+        _acceptConnections(poll.fdAcceptIdx);
+        if (poll.localAccepting) {
+            _acceptConnections(poll.fdLocalAcceptIdx);
+        }
+        if (config.metricsPort) {
+            _acceptConnections(poll.fdMetricsIdx);
+        }
+    }
+
+    // Accepts all the pending connections (up to a limit per wake-up, so that the game is never starved).
+    void _acceptConnections(int listenerIdx) {
+        if (poll.fds[listenerIdx].fd == -1 || !(poll.fds[listenerIdx].revents & POLLIN)) {
+            return;
+        }
+        const int MaxAcceptsPerWakeup = 64;
+        int rejected = 0, parked = 0;
+        for (int accepted = 0; accepted < MaxAcceptsPerWakeup; ++accepted) {
+            struct sockaddr_storage client_address{};
             socklen_t client_address_len = sizeof(client_address);
-            int client_fd = accept(poll.fds[poll.fdAcceptIdx].fd, (struct sockaddr *) &client_address,
-                                   &client_address_len);
+            int client_fd = accept4(poll.fds[listenerIdx].fd, (struct sockaddr *) &client_address,
+                                    &client_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
             if (client_fd < 0) {
-                syserr("accept");
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break; // the backlog is drained
+                }
+                if ((errno == EMFILE || errno == ENFILE) && reserveFd >= 0) {
+                    if (!_shedConnection(listenerIdx)) {
+                        break; // (drained meanwhile)
+                    }
+                    rejected++;
+                    continue;
+                }
+                if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE ||
+                    errno == ENOBUFS || errno == ENOMEM) {
+                    error("accept4 (transient)");
+                    break;
+                }
+                syserr("accept4");
+            }
+
+            // (all the local clients count as one host for the per-IP limit)
+            in6_addr ip = client_address.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &client_address)->sin6_addr : in6addr_loopback;
+            bool scrape = listenerIdx == poll.fdMetricsIdx;
+            auto pollfd = _admitConnection(ip) ? _freeCandidateSlot(!scrape) : nullptr;
+            if (pollfd == nullptr) {
+                // (the players may wait for a slot, also over their IP's candidate limit - parking has its own
+                // per-IP limit; the scrapes may not wait)
+                if (!scrape && poll.idle && poll.idle->park(client_fd, ip)) {
+                    parked++;
+                } else {
+                    _rejectConnection(client_fd);
+                    rejected++;
+                }
+                continue;
+            }
+            _startCandidate(pollfd, client_fd, scrape ? Polling::Candidate::State::Scrape : Polling::Candidate::State::WaitingForIAM, ip);
+
+            if (!scrape)
+                Reporter::log("New candidate connected.");
+        }
+        if (rejected > 0) {
+            Reporter::logWarning("Rejected " + std::to_string(rejected) + " connection(s) over the admission limits.");
+        }
+        if (parked > 0) {
+            Reporter::debug(Color::Yellow, "Parked " + std::to_string(parked) + " connection(s), " + std::to_string(poll.idle->size()) + " waiting for a slot.");
+        }
+    }
+
+    // Moves the parked connections that have sent something (their IAM, presumably) to the freed candidate slots,
+    // the longest waiting first. The ones that only keep the connection open stay parked. Returns whether it moved any.
+    bool _updateParkedConnections() {
+        bool promoted = false;
+        if (!poll.idle) {
+            return promoted;
+        }
+        while (poll.idle->hasReady()) {
+            auto pollfd = _freeCandidateSlot();
+            if (pollfd == nullptr) {
+                break;
             }
-
-            // Set to nonblocking mode.
-            if (fcntl(client_fd, F_SETFL, O_NONBLOCK)) {
-                syserr("fcntl");
+            // (a connection from an IP at its candidate limit stays parked, the next one may go first)
+            auto ready = poll.idle->takeReady([this](const in6_addr& ip) { return _admitConnection(ip); });
+            if (!ready) {
+                break;
             }
-
-            // find the first free pollfd
-            for (auto& pollfd: poll.fds) {
-                if (pollfd.fd == -1) {
-                    pollfd.fd = client_fd;
-                    pollfd.events = POLLIN;
-
-                    auto new_candidate = Polling::Candidate(&pollfd);
-                    poll.candidates.push_back(new_candidate);
-
-                    Reporter::log("New candidate connected.");
-                    return;
-                }
+            promoted = true;
+            auto handle = _startCandidate(pollfd, ready->fd, Polling::Candidate::State::WaitingForIAM, ready->ip);
+            auto& candidate = poll.candidates[handle];
+            candidate.buffer.preload(ready->input);
+            Reporter::log("Parked connection became a candidate.");
+            // (its IAM has arrived already, and the slot may be free again right away)
+            if (_processCandidate(candidate)) {
+                poll.candidates.release(handle);
             }
-            // or close the connection
-            Reporter::error("Is this a DoS attack? No free pollfd for candidate.");
-            close(client_fd);
         }
+        return promoted;
     }
 
     void acceptCandidateAsPlayer(Polling::Candidate& candidate, Seat seat) {
+        Tracer::Scope trace("acceptCandidateAsPlayer", Tracer::arg("seat", ::seatToString(seat)));
         assert(!players.at(seat).isConnected());
         auto& new_player = players.at(seat);
-        new_player.connect(std::move(candidate.buffer));
+        new_player.connect(candidate.buffer);
 
         // Send the whole deal history to the new player.
         if (game.byl_pierwszy_deal) {
-            new_player.buffer.writeMessage(Deal(game.currentDeal->dealType, game.currentDeal->firstSeat, game.currentDeal->cards[seat]));
-            for (auto& taken: game.takenHistory) {
-                new_player.buffer.writeMessage(taken);
-            }
+            EventCounters::add(EventCounters::Reconnects);
+            new_player.buffer.writeMessages(game.resyncMessages(seat, new_player.buffer.isBinary()));
 
             Reporter::debug(Color::Green, "Player " + ::seatToString(seat) + " connected and updated with history of (" + std::to_string(game.takenHistory.size()) + ") taken cards.");
             assert(players.at(seat).isConnected());
@@ -404,12 +2203,24 @@ private:
         }
     }
 
+    void acceptCandidateAsObserver(Polling::Candidate& candidate) {
+        if (std::ssize(observers.list) >= config.maxObservers) {
+            candidate.buffer.disconnect();
+            Reporter::logWarning("Observer rejected (" + std::to_string(observers.size()) + " observers already).");
+            return;
+        }
+        // the socket leaves the players' poll set (and frees its slot for another candidate)
+        observers.add(candidate.buffer.release());
+        Reporter::log("New observer connected (" + std::to_string(observers.size()) + " observers).");
+    }
+
     bool _processCandidateWaitingForIAM(Polling::Candidate& candidate) {
         assert(candidate.state == Polling::Candidate::State::WaitingForIAM);
 
         // Check timeout.
         if (time_ms() - candidate.connectionTime_ms >= config.timeout_ms()) {
             candidate.buffer.disconnect();
+            EventCounters::add(EventCounters::CandidateTimeouts);
             Reporter::log(Color::Red, "Candidate disconnected due to timeout.");
             Reporter::debug(Color::Cyan, "[delta: +" + std::to_string(time_ms() - candidate.connectionTime_ms > config.timeout_ms()) + "ms after timeout]");
             return true;
@@ -422,7 +2233,11 @@ private:
 
         // Syntax check: IAM message.
         std::string raw_msg = candidate.buffer.readMessage();
-        auto msg = Parser::parse(raw_msg);
+        auto msg = _parse(raw_msg, candidate.buffer.isBinary());
+        if (std::dynamic_pointer_cast<Watch>(msg)) {
+            acceptCandidateAsObserver(candidate);
+            return true;
+        }
         auto iam = std::dynamic_pointer_cast<IAm>(msg);
         if (iam == nullptr) {
             candidate.buffer.disconnect();
@@ -430,18 +2245,215 @@ private:
             return true;
         }
 
+        // from now on the candidate speaks the encoding of his choice
+        candidate.buffer.setBinary(iam->binary);
+
+        Seat seat = iam->seat;
+        if (iam->anySeat) {
+            if (config.lobby) {
+                // (a queued player has nothing to say until he is seated)
+                if (candidate.buffer.hasInput()) {
+                    candidate.buffer.disconnect();
+                    Reporter::debug(Color::Red, "Candidate disconnected due to a message after IAM*.");
+                    return true;
+                }
+                // (seated by _updateLobby, in the order of arrival)
+                candidate.state = Polling::Candidate::State::Queued;
+                candidate.connectionTime_ms = time_ms(); // (the lobby timeout starts now)
+                candidate.lobbyTicket = lobby.nextTicket++;
+                lobby.queue.push_back({poll.candidates.handleOf(candidate), candidate.lobbyTicket});
+                Reporter::log("Candidate joined the lobby.");
+                return false;
+            }
+            auto freeSeat = _freeSeat();
+            seat = freeSeat.value_or(seat); // (busy if there is none)
+        }
+
         // Semantic check: seat is not taken.
-        if (players.at(iam->seat).isConnected()) {
-            candidate.buffer.writeMessage(Busy(getTakenSeats()));
+        if (players.at(seat).isConnected()) {
+            candidate.buffer.writeMessage(busyMessages[takenSeatsMask()]);
             candidate.state = Polling::Candidate::State::Rejecting;
-            return false; // we cannot remove the candidate yet, but we changed its state
+            return _processCandidate(candidate); // the rejection may have been sent right away
         }
 
         // Accept the candidate.
-        acceptCandidateAsPlayer(candidate, iam->seat);
+        if (iam->anySeat) {
+            candidate.buffer.writeMessage(IAm(seat));
+        }
+        acceptCandidateAsPlayer(candidate, seat);
         return true; // very important: remove the candidate to prevent double processing
     }
 
+    // A seat for an IAM* or a lobby player: one nobody has played in this game yet, or one the robot has taken over
+    // (its player didn't come back within the grace period). Otherwise a disconnected player keeps his seat, hand
+    // and points until he reconnects.
+    std::optional<Seat> _freeSeat() const {
+        for (int i = 0; i < 4; ++i) {
+            const auto& player = players.at(seatFromIndex(i));
+            if (!player.isConnected() && (!game.byl_pierwszy_deal || player.robot)) {
+                return seatFromIndex(i);
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Gives the free seats to the players waiting in the lobby, returns whether it seated anyone.
+    bool _updateLobby() {
+        // (an entry is dead when its candidate has left the lobby, the slot may have been reused since)
+        auto isLive = [this](const Lobby::Entry& entry) {
+            return poll.candidates.contains(entry.handle) && poll.candidates[entry.handle].state == Polling::Candidate::State::Queued &&
+                   poll.candidates[entry.handle].lobbyTicket == entry.ticket;
+        };
+        while (!lobby.queue.empty() && !isLive(lobby.queue.front())) {
+            lobby.queue.pop_front();
+        }
+        // the dead entries behind the live ones are dropped once they outnumber them (there are a few live ones at most)
+        auto live = std::count_if(poll.candidates.begin(), poll.candidates.end(), [](const auto& candidate) {
+            return candidate.state == Polling::Candidate::State::Queued;
+        });
+        if (std::ssize(lobby.queue) > 2 * live) {
+            std::erase_if(lobby.queue, [&isLive](const auto& entry) { return !isLive(entry); });
+        }
+
+        bool seated = false;
+        while (!lobby.queue.empty()) {
+            auto freeSeat = _freeSeat();
+            if (!freeSeat) {
+                break;
+            }
+            auto entry = lobby.queue.front();
+            lobby.queue.pop_front();
+            if (!isLive(entry)) {
+                continue;
+            }
+            auto handle = entry.handle;
+            auto& candidate = poll.candidates[handle];
+            candidate.buffer.writeMessage(IAm(*freeSeat));
+            acceptCandidateAsPlayer(candidate, *freeSeat);
+            poll.candidates.release(handle);
+            seated = true;
+        }
+        return seated;
+    }
+
+    // A queued player waits silently (see _pollUpdate), but not forever.
+    bool _processQueued(Polling::Candidate& candidate) {
+        if (time_ms() - candidate.connectionTime_ms >= config.lobbyTimeout_ms) {
+            candidate.buffer.disconnect();
+            EventCounters::add(EventCounters::CandidateTimeouts);
+            Reporter::log(Color::Red, "Queued candidate disconnected due to the lobby timeout.");
+            return true;
+        }
+        return false;
+    }
+
+    bool _processScrape(Polling::Candidate& candidate) {
+        if (time_ms() - candidate.connectionTime_ms >= config.timeout_ms()) {
+            candidate.buffer.disconnect();
+            return true;
+        }
+        if (!candidate.buffer.hasMessage()) {
+            return false;
+        }
+        // any request gets the metrics (there is nothing else to serve)
+        candidate.buffer.readMessage();
+        std::string body = _prometheusMetrics();
+        candidate.buffer.writeMessage("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+        candidate.state = Polling::Candidate::State::Rejecting; // (closes the connection once the response is sent)
+        return _processCandidate(candidate);
+    }
+
+    // Live counters and gauges in the Prometheus text exposition format.
+    [[nodiscard]] std::string _prometheusMetrics() const {
+        std::string out;
+        auto family = [&out](const std::string& name, const std::string& type, const std::string& help) {
+            out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+        };
+        auto sample = [&out](const std::string& name, const std::string& labels, auto value) {
+            out += name + (labels.empty() ? "" : "{" + labels + "}") + " " + std::to_string(value) + "\n";
+        };
+
+        size_t candidatesByState[4]{};
+        for (const auto& candidate: poll.candidates) {
+            candidatesByState[candidate.state]++;
+        }
+        family("kierki_connections", "gauge", "Open connections by kind.");
+        sample("kierki_connections", "kind=\"player\"", std::count_if(players.begin(), players.end(), [](const auto& p) { return p.second.isConnected(); }));
+        sample("kierki_connections", "kind=\"observer\"", observers.size());
+        sample("kierki_connections", "kind=\"candidate\"", poll.candidates.size() - candidatesByState[Polling::Candidate::Scrape]);
+        sample("kierki_connections", "kind=\"parked\"", poll.idle ? poll.idle->size() : 0);
+        family("kierki_candidates", "gauge", "Connections without a seat by state.");
+        sample("kierki_candidates", "state=\"waiting_for_iam\"", candidatesByState[Polling::Candidate::WaitingForIAM]);
+        sample("kierki_candidates", "state=\"rejecting\"", candidatesByState[Polling::Candidate::Rejecting]);
+        sample("kierki_candidates", "state=\"scrape\"", candidatesByState[Polling::Candidate::Scrape]);
+        sample("kierki_candidates", "state=\"queued\"", candidatesByState[Polling::Candidate::Queued]);
+        family("kierki_robot_seats", "gauge", "Seats played by the server.");
+        sample("kierki_robot_seats", "", std::count_if(players.begin(), players.end(), [](const auto& p) { return p.second.robot; }));
+
+        // (there is one table; it's paused either in safePoll waiting for the players or by the backpressure)
+        bool active = allSeatsActive(), paused = _isTablePausedByBackpressure();
+        family("kierki_tables", "gauge", "Tables by state.");
+        sample("kierki_tables", "state=\"playing\"", int(active && !paused));
+        sample("kierki_tables", "state=\"waiting_for_players\"", int(!active));
+        sample("kierki_tables", "state=\"paused_backpressure\"", int(active && paused));
+        family("kierki_deal", "gauge", "Number of the current deal of the game (0 before the first one).");
+        sample("kierki_deal", "", game.byl_pierwszy_deal ? game.currentDealIndex + 1 : 0);
+
+        family("kierki_messages_total", "counter", "Protocol messages by direction and type (WRONG is the count of the rejected moves).");
+        for (bool incoming: {true, false}) {
+            for (int type = 0; type < MessageCounters::Types; ++type) {
+                sample("kierki_messages_total", std::string("direction=\"") + (incoming ? "in" : "out") + "\",type=\"" + MessageCounters::names[type] + "\"",
+                       MessageCounters::sum(MessageCounters::index(incoming, static_cast<MessageCounters::Type>(type))));
+            }
+        }
+        family("kierki_timeouts_total", "counter", "Timeouts by kind.");
+        sample("kierki_timeouts_total", "kind=\"trick\"", EventCounters::sum(EventCounters::TrickTimeouts));
+        sample("kierki_timeouts_total", "kind=\"candidate\"", EventCounters::sum(EventCounters::CandidateTimeouts));
+        family("kierki_reconnects_total", "counter", "Players who came back to a game in progress.");
+        sample("kierki_reconnects_total", "", EventCounters::sum(EventCounters::Reconnects));
+        family("kierki_disconnects_total", "counter", "Players who lost the connection (or were too slow).");
+        sample("kierki_disconnects_total", "", EventCounters::sum(EventCounters::Disconnections));
+        family("kierki_rejected_connections_total", "counter", "Connections over the admission limits.");
+        sample("kierki_rejected_connections_total", "", EventCounters::sum(EventCounters::RejectedConnections));
+        family("kierki_output_queued_bytes", "gauge", "Unsent output by kind of the receiver.");
+        sample("kierki_output_queued_bytes", "kind=\"player\"", _queuedBytes());
+        sample("kierki_output_queued_bytes", "kind=\"observer\"", observers.queuedBytes());
+
+        family("kierki_heap_allocations_total", "counter", "Global heap allocations of the server loop.");
+        sample("kierki_heap_allocations_total", "", AllocationCounter::count);
+        family("kierki_heap_allocated_bytes_total", "counter", "Bytes of the global heap allocations of the server loop.");
+        sample("kierki_heap_allocated_bytes_total", "", AllocationCounter::bytes);
+        family("kierki_last_deal_heap_allocations", "gauge", "Global heap allocations during the last finished deal.");
+        sample("kierki_last_deal_heap_allocations", "", metrics.lastDealAllocations);
+        family("kierki_last_deal_heap_allocated_bytes", "gauge", "Bytes of the global heap allocations during the last finished deal.");
+        sample("kierki_last_deal_heap_allocated_bytes", "", metrics.lastDealBytes);
+
+        auto summary = [&](const std::string& name, const std::string& help, const std::vector<std::pair<std::string, const LatencyHistogram*>>& series) {
+            family(name, "summary", help);
+            for (const auto& [labels, histogram]: series) {
+                std::string prefix = labels.empty() ? "" : labels + ",";
+                for (double q: {0.5, 0.9, 0.99, 0.999}) {
+                    std::ostringstream quantile;
+                    quantile << q;
+                    sample(name, prefix + "quantile=\"" + quantile.str() + "\"", histogram->percentile(q) / 1e6);
+                }
+                sample(name + "_sum", labels, histogram->sum_us() / 1e6);
+                sample(name + "_count", labels, histogram->count());
+            }
+        };
+        std::vector<std::pair<std::string, const LatencyHistogram*>> turns;
+        for (int seat = 0; seat < 4; ++seat) {
+            turns.emplace_back("seat=\"" + ::seatToString(seatFromIndex(seat)) + "\"", &metrics.turn[seat]);
+        }
+        summary("kierki_turn_latency_seconds", "TRICK sent to TRICK received.", turns);
+        summary("kierki_parse_seconds", "Parsing of a received message.", {{"", &metrics.parse}});
+        summary("kierki_step_seconds", "One call of the state function.", {{"", &metrics.step}});
+        summary("kierki_poll_wait_seconds", "Time spent in poll.", {{"", &metrics.pollWait}});
+        summary("kierki_poll_busy_seconds", "Time spent between the polls.", {{"", &metrics.pollBusy}});
+        return out;
+    }
+
     // Updates the candidate messages and
     // - returns true iff the candidate should be removed (for example due to timeout, wrong message, disconnection etc.)
     bool _processCandidate(Polling::Candidate &candidate) {
@@ -451,6 +2463,12 @@ private:
         if (candidate.state == Polling::Candidate::State::WaitingForIAM) {
             return _processCandidateWaitingForIAM(candidate);
         }
+        else if (candidate.state == Polling::Candidate::State::Scrape) {
+            return _processScrape(candidate);
+        }
+        else if (candidate.state == Polling::Candidate::State::Queued) {
+            return _processQueued(candidate);
+        }
         else if (candidate.state == Polling::Candidate::State::Rejecting) {
             // only if it has finished writing the rejection message
             if (!candidate.buffer.isWriting()) {
@@ -466,32 +2484,160 @@ private:
     }
 
     void _updateCandidateMessages() {
-        for (auto candidate = poll.candidates.begin(); candidate != poll.candidates.end(); /*candidate++*/) {
+        for (auto candidate = poll.candidates.begin(); candidate != poll.candidates.end(); ++candidate) {
             if (_processCandidate(*candidate)) {
-                // remove the candidate
-                candidate = poll.candidates.erase(candidate);
-            } else {
-                ++candidate;
+                // return the candidate to the pool
+                poll.candidates.release(candidate.handle());
+            }
+        }
+    }
+
+    void _updateHandoffRequest() {
+        auto& listener = poll.fds[poll.fdHandoffIdx];
+        if (config.handoffPath && handoffPeer < 0 && (listener.revents & POLLIN)) {
+            handoffPeer = accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (handoffPeer < 0) {
+                error("accept4 (handoff)");
+                return;
+            }
+            listener.events = 0; // one successor at a time
+            Reporter::log(Color::Yellow, "A new server is taking over, the table will be handed off at the next trick.");
+        }
+        if (handoffPeer >= 0 && !game.byl_pierwszy_deal) {
+            _handOff(); // the game hasn't started, nothing to wait for
+        }
+    }
+
+    // Passes the table to the successor and exits (see Handoff). Called only between the tricks or before the game.
+    void _handOff() {
+        Tracer::instant("handOff");
+        std::vector<PollBuffer*> buffers;
+        for (auto& [seat, player]: players) {
+            buffers.push_back(&player.buffer);
+        }
+        PollBuffer::flushAll(buffers, time_ms() + config.timeout_ms());
+
+        Handoff::Header header{};
+        memcpy(header.magic, Handoff::Magic, sizeof(Handoff::Magic));
+        header.version = Handoff::Version;
+        header.started = game.byl_pierwszy_deal;
+        if (game.byl_pierwszy_deal) {
+            header.state = _snapshotState();
+        }
+        std::vector<int> fds{poll.fds[poll.fdAcceptIdx].fd};
+        if (poll.localAccepting) {
+            header.localListener = 1;
+            fds.push_back(poll.fds[poll.fdLocalAcceptIdx].fd);
+        }
+        std::string input;
+        for (int i = 0; i < 4; ++i) {
+            auto& player = players.at(seatFromIndex(i));
+            // (a player whose output couldn't be flushed is left to reconnect and get the history again)
+            if (player.isConnected() && !player.buffer.hasError() && !player.buffer.isWriting()) {
+                header.connectedSeats |= 1 << i;
+                header.binarySeats |= player.buffer.isBinary() << i;
+                header.inputSizes[i] = static_cast<uint32_t>(player.buffer.input().size());
+                input += player.buffer.input();
+                fds.push_back(player.buffer.fd());
+            }
+            if (player.robot) {
+                header.robotSeats |= 1 << i;
             }
         }
+
+        if (!Handoff::send(handoffPeer, header, fds, input)) {
+            Reporter::logError("Handoff failed, the server goes on.");
+            close(handoffPeer);
+            handoffPeer = -1;
+            poll.fds[poll.fdHandoffIdx].events = POLLIN;
+            return;
+        }
+        Reporter::log(Color::Yellow, "The table has been handed off. Exiting the server... o7");
+        exit(0);
+    }
+
+    // Takes the table over from the server running with the same handoff path (if there is one).
+    bool _takeOver(const std::string& path) {
+        int peer = Handoff::connectToPredecessor(path);
+        if (peer < 0) {
+            return false;
+        }
+        Reporter::log(Color::Yellow, "Waiting for the running server to hand off the table...");
+        Handoff::Header header{};
+        std::vector<int> fds;
+        std::string input;
+        // (the running server hands off at the next trick, i.e. after at most 4 turns and flushing the output)
+        bool received = Handoff::receive(peer, header, fds, input, 5 * config.timeout_ms());
+        close(peer);
+        if (!received) {
+            fatal("Handoff from the running server failed (or it didn't come in time).");
+        }
+
+        poll.fds[poll.fdAcceptIdx] = {.fd = fds[0], .events = POLLIN, .revents = 0};
+        int next = 1;
+        if (header.localListener) {
+            poll.fds[poll.fdLocalAcceptIdx] = {.fd = fds[next++], .events = POLLIN, .revents = 0};
+            poll.localAccepting = true;
+        }
+        if (header.started) {
+            if (!_restoreSnapshot(header.state)) {
+                fatal("The running server plays different deals.");
+            }
+            ChangeState("stateStartTrick", [this] { stateStartTrick(game.trickNumber); });
+        }
+        size_t inputOffset = 0;
+        for (int i = 0; i < 4; ++i) {
+            auto& player = players.at(seatFromIndex(i));
+            if (header.connectedSeats >> i & 1) {
+                // (the reserved slots are skipped, the handoff, metrics and parking ones are opened later)
+                auto pollfd = std::find_if(std::begin(poll.fds) + poll.fdIdleIdx + 1, std::end(poll.fds), [](const auto& fd) { return fd.fd == -1; });
+                pollfd->fd = fds[next++];
+                PollBuffer buffer(&*pollfd);
+                buffer.setWatermarks(config.outputHighWatermark, config.outputLowWatermark());
+                buffer.setBinary(header.binarySeats >> i & 1);
+                buffer.preload(std::string_view(input).substr(inputOffset, header.inputSizes[i]));
+                inputOffset += header.inputSizes[i];
+                player.connect(buffer);
+            }
+            player.robot = header.robotSeats >> i & 1;
+        }
+        Reporter::log(Color::Yellow, "Took over the table with " + std::to_string(std::popcount(header.connectedSeats)) + " player(s) connected.");
+        return true;
     }
 
     void safePoll() {
+        Tracer::Scope trace("safePoll");
         while (true) {
+            // the players are served, now it's time for the observers (without blocking)
+            observers.flush();
+
             // ----------- reset revents, run poll and updateBuffers the player poll players ------------
             _pollUpdate();
 
             // (1) updateBuffers disconnections and remove disconnected players
             _updateDisconnections();
 
-            // (2) check if there are any new connections
+            // (2) check if there are any new connections (the parked ones waiting for a slot go first)
+            _updateParkedConnections();
             _updateNewConnections();
 
-            // (3) check if there are any new IAM messages from candidates
+            // (3) check if there are any new IAM messages from candidates (the parked ones take the freed slots)
             _updateCandidateMessages();
+            // (the seated lobby players free their slots for the parked connections, which may join the lobby in turn)
+            bool moved;
+            do {
+                moved = _updateLobby();
+                moved = _updateParkedConnections() || moved;
+            } while (moved);
+
+            // (4) let the robots play for the players who don't come back
+            _updateRobotTakeovers();
 
-            // return if all players are connected
-            if (std::all_of(players.begin(), players.end(), [](const auto &p) { return p.second.isConnected(); })) {
+            // (5) check if a new server wants to take over
+            _updateHandoffRequest();
+
+            // return if all players are connected (or replaced by robots)
+            if (allSeatsActive()) {
                 Reporter::debug(Color::Green, "Safe poll finished. All players connected!");
                 return;
             }
@@ -500,8 +2646,16 @@ private:
     }
 
     struct GameData {
-        std::vector<DealConfig>::iterator currentDeal;
-        std::vector<Taken> takenHistory;
+        size_t currentDealIndex = 0;
+        DealConfig currentDeal;
+        std::pmr::vector<Taken> takenHistory;
+        // serialized messages of the current deal, reused by every (re)connecting player
+        std::array<WireMessage, 4> dealMessages; // DEAL for each seat (by seatIndex)
+        std::string observerDealMessage; // DEAL without the hand
+        WireMessage takenHistoryMessages; // all TAKEN messages so far
+        std::array<std::string, 4> resyncCache; // DEAL + TAKEN history for each seat...
+        std::array<size_t, 4> resyncCacheTricks{}; // ...valid as long as the history has this many tricks...
+        std::array<bool, 4> resyncCacheBinary{}; // ...and the player uses the same encoding
         std::vector<Card> cardsOnTable;
 
         int trickNumber = Trick::FirstTrickNumber; // 1-13
@@ -511,14 +2665,44 @@ private:
 
         bool byl_pierwszy_deal = false; // specjalnie po polsku, zeby wyifowac przypadek wysylania dealow na samym poczatku gry
 
+        explicit GameData(std::pmr::memory_resource* arena) : takenHistory(arena) {
+            takenHistory.reserve(Trick::LastTrickNumber);
+            cardsOnTable.reserve(4);
+        }
+
+        // Prepares the data for a new game (keeping the allocated memory).
+        void reset() {
+            currentDealIndex = 0;
+            takenHistory.clear();
+            takenHistoryMessages.clear();
+            cardsOnTable.clear();
+            trickNumber = Trick::FirstTrickNumber;
+            currentPlayer = nullptr;
+            trickWinnerSeat = Seat{};
+            byl_pierwszy_deal = false;
+        }
+
+        // The whole state of the deal for a (re)connecting player, cached per trick.
+        const std::string& resyncMessages(Seat seat, bool binary) {
+            int i = seatIndex(seat);
+            if (resyncCache[i].empty() || resyncCacheTricks[i] != takenHistory.size() || resyncCacheBinary[i] != binary) {
+                resyncCache[i].clear();
+                resyncCache[i] += dealMessages[i].encoded(binary);
+                resyncCache[i] += takenHistoryMessages.encoded(binary);
+                resyncCacheTricks[i] = takenHistory.size();
+                resyncCacheBinary[i] = binary;
+            }
+            return resyncCache[i];
+        }
+
         // Assume: trickNumber is set for the current trick.
         [[nodiscard]] Seat getStartingSeat() const {
             if (trickNumber == Trick::FirstTrickNumber) {
-                return currentDeal->firstSeat;
+                return currentDeal.firstSeat;
             }
             return trickWinnerSeat;
         }
-    } game;
+    } game{&tableArena};
 
     // ======================================= State machine =============================================
     // variable pointing to function that handles current state (use wrappers not raw function pointers)
@@ -526,8 +2710,11 @@ private:
     // whether the state should updateBuffers poll before calling the state function
     bool stateShouldPoll = true;
 
-    // Function to change the current state.
-    void ChangeState(std::function<void()> newState, bool should_poll_before_next_state_call = true) {
+    // Function to change the current state ('name' is the state's, for the trace).
+    void ChangeState(const char* name, std::function<void()> newState, bool should_poll_before_next_state_call = true) {
+        if (Tracer::isEnabled()) {
+            Tracer::instant("ChangeState", std::string("{\"state\":\"") + name + "\",\"poll\":" + (should_poll_before_next_state_call ? "true}" : "false}"));
+        }
         state = std::move(newState);
         stateShouldPoll = should_poll_before_next_state_call;
     }
@@ -536,32 +2723,21 @@ private:
     void _checkOtherPlayersMessages() {
         for (auto& [seat, player]: players) {
             if (player.buffer.hasMessage() && seat != game.currentPlayer->seat) {
-                auto msg = Parser::parse(player.buffer.readMessage());
+                auto msg = _parse(player.buffer.readMessage(), player.buffer.isBinary());
                 if (auto trick = std::dynamic_pointer_cast<Trick>(msg)) {
                     Reporter::logWarning("Player " + ::seatToString(seat) + " sent a TRICK message, but it's not his turn.");
-                    player.buffer.writeMessage(Wrong(game.trickNumber));
+                    player.send(Wrong(game.trickNumber));
                 } else {
                     Reporter::logError("Player " + ::seatToString(seat) + ": unexpected message received. Closing connection.");
-                    player.disconnect();
+                    player.disconnect(config.timeout_ms());
+                    EventCounters::add(EventCounters::Disconnections);
                 }
             }
         }
     }
 
     Player* _whoTakesTrick() {
-        assert(game.cardsOnTable.size() == 4);
-        auto firstCardSuit = game.cardsOnTable[0].suit;
-        auto winningCard = game.cardsOnTable[0];
-        Player* winnerPlayer = &players.at(game.getStartingSeat());
-
-        for (auto [i, player] = std::tuple(0, winnerPlayer); i < std::ssize(game.cardsOnTable); i++, player = &players.at(nextSeat(player->seat))) {
-            if (game.cardsOnTable[i].suit == firstCardSuit && winningCard < game.cardsOnTable[i]) {
-                winningCard = game.cardsOnTable[i];
-                winnerPlayer = player;
-            }
-        }
-
-        return winnerPlayer;
+        return &players.at(trickTaker(game.cardsOnTable, game.getStartingSeat()));
     }
 
     void _sendScoresAndTotals() {
@@ -572,9 +2748,11 @@ private:
             {Seat::S, players.at(Seat::S).stats.points_deal},
             {Seat::W, players.at(Seat::W).stats.points_deal}
         });
+        WireMessage scoreMessage(score);
         for (auto& [seat, player]: players) {
-            player.buffer.writeMessage(score);
+            player.send(scoreMessage);
         }
+        observers.publish(scoreMessage.text);
 
         Total total(std::unordered_map<Seat, int>{
             {Seat::N, players.at(Seat::N).stats.points_total},
@@ -582,49 +2760,116 @@ private:
             {Seat::S, players.at(Seat::S).stats.points_total},
             {Seat::W, players.at(Seat::W).stats.points_total}
         });
+        WireMessage totalMessage(total);
         for (auto& [seat, player]: players) {
-            player.buffer.writeMessage(total);
+            player.send(totalMessage);
         }
+        observers.publish(totalMessage.text);
     }
 
     void _finalizeDeal() {
         // Send the score and total messages to all players (it's done at the end of each deal)
         _sendScoresAndTotals();
+        metrics.lastDealAllocations = AllocationCounter::count - metrics.dealStartAllocations;
+        metrics.lastDealBytes = AllocationCounter::bytes - metrics.dealStartBytes;
+        Reporter::debug(Color::Cyan, "Deal " + std::to_string(game.currentDealIndex + 1) + " made " + std::to_string(metrics.lastDealAllocations) +
+                                     " heap allocations (" + std::to_string(metrics.lastDealBytes) + " bytes).");
 
         // If the deal is not over yet, continue with the next deal and set the state to stateStartTrick
-        if (game.currentDeal != config.deals.end() - 1) {
-            setCurrentDeal(game.currentDeal + 1);
+        if (game.currentDealIndex + 1 < config.deals.size()) {
+            setCurrentDeal(game.currentDealIndex + 1);
             sendDealInfo(); // we assume that the players are 'atomically' still connected since the last safePoll
-            ChangeState([this] { stateStartTrick(Trick::FirstTrickNumber); });
+            // the messages are (usually) already sent, so there is nothing to wait for unless someone has disconnected meanwhile
+            ChangeState("stateStartTrick", [this] { stateStartTrick(Trick::FirstTrickNumber); }, !allSeatsActive());
             return;
         }
 
         // *** The game is over! ***
-        poll.stopAccepting();
+        if (snapshot) {
+            snapshot->clear(); // nothing to recover anymore
+        }
+        if (!config.persistent) {
+            poll.stopAccepting();
+        }
         Reporter::log("Game is over. Disconnecting all players.");
+        Reporter::log(Color::Cyan, metrics.toString());
+        std::vector<PollBuffer*> buffers;
+        for (auto& [seat, player]: players) {
+            buffers.push_back(&player.buffer);
+        }
+        PollBuffer::flushAll(buffers, time_ms() + config.timeout_ms()); // very important! send the last messages (with one shared timeout)
         for (auto& [seat, player]: players) {
-            player.buffer.flush(config.timeout_s()); // very important! this can block, but it's the last message anyway
-            player.disconnect();
+            player.disconnect(config.timeout_ms());
             Reporter::log("Player " + ::seatToString(seat) + " disconnected.");
         }
 
+        if (config.persistent) {
+            Tracer::flush(); // one game at a time (otherwise at the exit)
+            observers.flush(); // the observers stay for the next game
+            _startNewGame();
+            return;
+        }
+
+        observers.closeAll(time_ms() + config.timeout_ms());
         Reporter::log("Exiting the server... o7");
         exit(0);
     }
+    // Resets the game and the players' stats and waits (on the same listening socket) for players of the next game.
+    // Drops the whole dynamic state of the table at once (at the end of a game): the containers give their memory back
+    // to the arena, which then returns it to the heap.
+    void _releaseTableArena() {
+        game.takenHistory = std::pmr::vector<Taken>(&tableArena);
+        for (auto& [seat, player]: players) {
+            player.stats.hand.clear();
+            player.stats.tricks_taken = std::pmr::vector<std::pmr::vector<Card>>(&tableArena);
+        }
+        tableArena.release();
+        game.takenHistory.reserve(Trick::LastTrickNumber);
+    }
+
+    void _startNewGame() {
+        game.reset();
+        _releaseTableArena();
+        for (auto& [seat, player]: players) {
+            player.stats.points_total = 0;
+            player.trickRequestTime_ms = 0;
+            player.robot = false;
+        }
+        setCurrentDeal(0);
+        ChangeState("stateStartTrick", [this] { stateStartTrick(Trick::FirstTrickNumber); });
+        Reporter::log("Waiting for players of the next game...");
+    }
+
     // TRICK -> N   | safePoll | wait (no msg) | safePoll | wait (no msg) | safePoll (N disconnected, N connected) | wait (no msg) - timeout - RESEND TRICK -> N |
     bool isDealResultDetermined() const {
-        return game.trickNumber == Trick::LastTrickNumber;
+        return game.trickNumber == Trick::LastTrickNumber || !_canRemainingTricksScore();
+    }
+
+    // Whether any penalty can still be taken in the rest of the deal (if not, the remaining tricks are pointless).
+    bool _canRemainingTricksScore() const {
+        auto dealType = game.currentDeal.dealType;
+        if (dealType == DealType::NoTricks || dealType == DealType::No7AndLastTrick || dealType == DealType::Robber) {
+            return true; // every trick (or at least the last one) is a penalty
+        }
+        for (const auto& [seat, player]: players) {
+            for (const auto& card: player.stats.hand) {
+                if (countPoints({card}, dealType, 0) > 0) { // (trick number 0 - only the card itself counts)
+                    return true;
+                }
+            }
+        }
+        return false;
     }
 
-    void _handleCorrectTrick(std::shared_ptr<Trick> trick) {
+    void _handleCorrectTrick(const Card& card) {
         // Update the cards on the table and in the player's hand
-        game.cardsOnTable.push_back(trick->cards[0]);
-        game.currentPlayer->stats.removeCard(trick->cards[0]);
+        game.cardsOnTable.push_back(card);
+        game.currentPlayer->stats.removeCard(card);
 
         // If the current player is NOT the last one in the trick (4th player)...
         if (game.cardsOnTable.size() < 4) {
             game.currentPlayer = &players.at(nextSeat(game.currentPlayer->seat));
-            ChangeState([this] { stateSendTrick(); }, false);
+            ChangeState("stateSendTrick", [this] { stateSendTrick(); }, false);
             return;
         }
 
@@ -635,21 +2880,24 @@ private:
         game.trickWinnerSeat = winner->seat;
 
         // Update the stats of the players (actually just the winner, the rest is unchanged)
-        int points = countPoints(game.cardsOnTable, game.currentDeal->dealType, game.trickNumber);
+        int points = countPoints(game.cardsOnTable, game.currentDeal.dealType, game.trickNumber);
         winner->stats.takeTrick(game.cardsOnTable, points);
 
         // Send the taken message to all players (including the winner) and updateBuffers the history of taken cards
         Taken taken(game.trickNumber, game.cardsOnTable, winner->seat);
+        WireMessage takenMessage(taken);
         for (auto& [seat, player]: players) {
-            player.buffer.writeMessage(taken);
+            player.send(takenMessage);
         }
+        observers.publish(takenMessage.text);
         game.takenHistory.push_back(taken);
+        game.takenHistoryMessages += takenMessage;
 
 
         // If the deal is not over yet, continue with the next trick
         if (!isDealResultDetermined()) {
             game.trickNumber++; assert(game.trickNumber <= Trick::LastTrickNumber);
-            ChangeState([this] { stateStartTrick(game.trickNumber); });
+            ChangeState("stateStartTrick", [this] { stateStartTrick(game.trickNumber); }, !allSeatsActive());
             return;
         }
 
@@ -659,13 +2907,17 @@ private:
 
     void _handleMessageFromCurrentPlayer() {
         auto raw_msg = game.currentPlayer->buffer.readMessage();
-        auto msg = Parser::parse(raw_msg);
+        auto msg = _parse(raw_msg, game.currentPlayer->buffer.isBinary());
         auto trick = std::dynamic_pointer_cast<Trick>(msg);
+        if (trick != nullptr) {
+            metrics.turn[seatIndex(game.currentPlayer->seat)].record(time_us() - game.currentPlayer->trickRequestTime_us);
+        }
 
         // Syntax check: TRICK message
         if (trick == nullptr) {
             Reporter::logError("Player " + ::seatToString(game.currentPlayer->seat) + ": unexpected message received. Closing connection.");
-            game.currentPlayer->disconnect();
+            game.currentPlayer->disconnect(config.timeout_ms());
+            EventCounters::add(EventCounters::Disconnections);
             return; // and keep the WaitForTrick state
         }
 
@@ -701,15 +2953,22 @@ private:
         }
 
         // *** The trick is correct! ***
-        _handleCorrectTrick(trick);
+        _handleCorrectTrick(trick->cards[0]);
     }
 
     void stateWaitForTrick() {
+        Tracer::Scope trace("stateWaitForTrick");
         // Poll is already called and has some revents (possibly only timeout)
-        // Assumption: all players are connected!
+        // Assumption: all players are connected (or replaced by robots)!
         for (auto& [seat, player]: players) {
-            assert(player.isConnected());
-            assert(player.buffer.hasError() == false);
+            assert(player.isActive());
+            assert(!player.isConnected() || player.buffer.hasError() == false);
+        }
+
+        // the current player has been replaced by a robot while we were waiting for him
+        if (game.currentPlayer->robot) {
+            ChangeState("stateSendTrick", [this] { stateSendTrick(); }, false);
+            return;
         }
 
         // --------------------------------------------- Main logic ----------------------------------------------
@@ -735,7 +2994,7 @@ private:
         //                - updateBuffers the trickWinnerSeat
         //                - updateBuffers the stats (scores etc.) according to the type of the current deal (e.g. No7AndLastTrick)
         //                - send the taken message to all players (including the winner) and updateBuffers the history of taken cards
-        //                - if deal has NOT finished (meaning that the trick number is Trick::LastTrickNumber OR [todo] all penalties have been taken)
+        //                - if deal has NOT finished (meaning that the trick number is Trick::LastTrickNumber OR all penalties have been taken)
         //                    - change the state to stateStartTrick(trick number + 1)
         //                - else
         //                    -> call _finishDeal() (it will send the scores and totals and change the deal to the next one or finish the game)
@@ -752,55 +3011,225 @@ private:
         }
         // 2) or else, if there was a timeout for the *current* player (only the current player can timeout):
         else if (time_ms() - game.currentPlayer->trickRequestTime_ms >= config.timeout_ms()) {
+            EventCounters::add(EventCounters::TrickTimeouts);
             Reporter::logWarning("Player " + ::seatToString(game.currentPlayer->seat) + " did not respond in time. ");
             Reporter::debug(Color::Cyan, "[delta: +" + std::to_string(time_ms() - game.currentPlayer->trickRequestTime_ms > config.timeout_ms()) + "ms after timeout]");
-            ChangeState([this] { stateSendTrick(); }, false);
+            ChangeState("stateSendTrick", [this] { stateSendTrick(); }, false);
         }
 
     }
 
     void stateSendTrick() {
+        Tracer::Scope trace("stateSendTrick");
+        if (game.currentPlayer->robot) {
+            // the robot plays right away (its choice is always correct)
+            _handleCorrectTrick(game.currentPlayer->stats.chooseLegalCard(game.cardsOnTable));
+            return;
+        }
         game.currentPlayer->buffer.writeMessage(Trick(game.trickNumber, game.cardsOnTable));
         game.currentPlayer->trickRequestTime_ms = time_ms();
+        game.currentPlayer->trickRequestTime_us = time_us();
 
-        ChangeState([this] { stateWaitForTrick(); });
+        ChangeState("stateWaitForTrick", [this] { stateWaitForTrick(); });
     }
 
     void stateStartTrick(int trickNumber) {
+        Tracer::Scope trace("stateStartTrick");
+        if (Tracer::isEnabled()) trace.args = "{\"trick\":" + std::to_string(trickNumber) + "}";
         assert(Trick::FirstTrickNumber <= trickNumber && trickNumber <= Trick::LastTrickNumber);
 
+        _handBackRobotSeats();
+
         game.trickNumber = trickNumber;
         game.currentPlayer = &players.at(game.getStartingSeat());
         game.cardsOnTable.clear();
 
-        ChangeState([this] { stateSendTrick(); }, false);
+        if (snapshot) {
+            snapshot->save(_snapshotState());
+        }
+        if (handoffPeer >= 0) {
+            _handOff(); // (exits unless the successor is gone)
+        }
+
+        ChangeState("stateSendTrick", [this] { stateSendTrick(); }, false);
     }
 
-    void setCurrentDeal(const std::vector<DealConfig>::iterator& dealIt) {
-        game.currentDeal = dealIt;
+    void setCurrentDeal(size_t dealIndex) {
+        game.currentDealIndex = dealIndex;
+        game.currentDeal = config.deals.at(dealIndex);
         game.takenHistory.clear();
+        game.takenHistoryMessages.clear();
+        for (auto& [seat, player]: players) {
+            auto cards = game.currentDeal.cardsOf(seat);
+            game.dealMessages[seatIndex(seat)] = WireMessage(Deal(game.currentDeal.dealType, game.currentDeal.firstSeat, cards));
+            game.resyncCache[seatIndex(seat)].clear();
+            player.stats.takeNewDeal(cards, game.currentDeal.dealType);
+        }
+        game.observerDealMessage = Deal(game.currentDeal.dealType, game.currentDeal.firstSeat, {}).toString();
+    }
+
+    // The table at the beginning of the current trick (see TableSnapshot).
+    [[nodiscard]] TableSnapshot::State _snapshotState() const {
+        TableSnapshot::State state{};
+        state.dealIndex = game.currentDealIndex;
+        for (const auto& [seat, player]: players) {
+            int i = seatIndex(seat);
+            for (const auto& card: player.stats.hand) {
+                state.hands[i] |= uint64_t{1} << card.index();
+            }
+            state.pointsDeal[i] = player.stats.points_deal;
+            state.pointsTotal[i] = player.stats.points_total;
+        }
+        state.takenCount = static_cast<uint8_t>(game.takenHistory.size());
+        for (size_t trick = 0; trick < game.takenHistory.size(); ++trick) {
+            const auto& taken = game.takenHistory[trick];
+            for (int i = 0; i < 4; ++i) {
+                state.taken[trick][i] = taken.cardsOnTable[i].index();
+            }
+            state.taken[trick][4] = static_cast<uint8_t>(seatIndex(taken.takerSeat));
+        }
+        return state;
+    }
+
+    // Checks that the snapshot fits the current deals: each card is either in the hand it was dealt to or taken.
+    [[nodiscard]] bool _isSnapshotConsistent(const TableSnapshot::State& state) const {
+        if (state.dealIndex >= config.deals.size() || state.takenCount >= Trick::LastTrickNumber) {
+            return false;
+        }
+        DealConfig deal = config.deals.at(state.dealIndex);
+        uint64_t seen = 0;
+        for (int seat = 0; seat < 4; ++seat) {
+            uint64_t dealt = 0;
+            for (uint8_t cardIndex: deal.cards[seat]) {
+                dealt |= uint64_t{1} << cardIndex;
+            }
+            if ((state.hands[seat] & ~dealt) != 0 || std::popcount(state.hands[seat]) != DealConfig::CardsPerSeat - state.takenCount) {
+                return false;
+            }
+            seen |= state.hands[seat];
+        }
+        for (int trick = 0; trick < state.takenCount; ++trick) {
+            for (int i = 0; i < 4; ++i) {
+                uint8_t cardIndex = state.taken[trick][i];
+                if (cardIndex >= Card::DeckSize || (seen >> cardIndex & 1)) {
+                    return false;
+                }
+                seen |= uint64_t{1} << cardIndex;
+            }
+            if (state.taken[trick][4] >= 4) {
+                return false;
+            }
+        }
+        return seen == (uint64_t{1} << Card::DeckSize) - 1;
+    }
+
+    // Restores the table saved before a crash; the players get the deal history when they reconnect to their seats.
+    bool _restoreSnapshot(const TableSnapshot::State& state) {
+        if (!_isSnapshotConsistent(state)) {
+            return false;
+        }
+        setCurrentDeal(state.dealIndex);
+        _markDealStart(); // (the restored deal is never sent again, its count starts with the restore)
         for (auto& [seat, player]: players) {
-            player.stats.takeNewDeal(game.currentDeal->cards[seat], game.currentDeal->dealType);
+            int i = seatIndex(seat);
+            player.stats.hand.clear();
+            for (uint8_t cardIndex = 0; cardIndex < Card::DeckSize; ++cardIndex) {
+                if (state.hands[i] >> cardIndex & 1) {
+                    player.stats.hand.insert(Card::fromIndex(cardIndex));
+                }
+            }
+            player.stats.points_deal = state.pointsDeal[i];
+            player.stats.points_total = state.pointsTotal[i];
+            player.disconnectionTime_ms = time_ms(); // (the robots' grace period starts now)
+        }
+        for (int trick = 0; trick < state.takenCount; ++trick) {
+            std::vector<Card> cards;
+            for (int i = 0; i < 4; ++i) {
+                cards.push_back(Card::fromIndex(state.taken[trick][i]));
+            }
+            Seat taker = seatFromIndex(state.taken[trick][4]);
+            Taken taken(trick + 1, cards, taker);
+            players.at(taker).stats.tricks_taken.emplace_back(cards.begin(), cards.end());
+            game.takenHistoryMessages += WireMessage(taken);
+            game.takenHistory.push_back(std::move(taken));
+            game.trickWinnerSeat = taker;
         }
+        game.trickNumber = state.takenCount + 1;
+        game.byl_pierwszy_deal = true;
+
+        observers.startDeal();
+        observers.publish(game.observerDealMessage);
+        observers.publish(game.takenHistoryMessages.text);
+        return true;
+    }
+
+    // A deal's allocations are counted from here (not from setCurrentDeal, which for the first deal runs long before
+    // the players connect) to its SCORE and TOTAL.
+    void _markDealStart() {
+        metrics.dealStartAllocations = AllocationCounter::count;
+        metrics.dealStartBytes = AllocationCounter::bytes;
     }
 
     void sendDealInfo() {
+        _markDealStart();
         for (auto& [seat, player]: players) {
-            player.buffer.writeMessage(Deal(game.currentDeal->dealType, game.currentDeal->firstSeat, game.currentDeal->cards[seat]));
+            player.send(game.dealMessages[seatIndex(seat)]);
+        }
+        observers.startDeal();
+        observers.publish(game.observerDealMessage);
+    }
+
+    // Continues the game interrupted by a crash (if there was one).
+    void _restoreFromSnapshot() {
+        if (snapshot) {
+            if (auto saved = snapshot->load()) {
+                if (_restoreSnapshot(*saved)) {
+                    Reporter::log(Color::Yellow, "Restored the table from the snapshot: deal " + std::to_string(game.currentDealIndex + 1) +
+                                                 ", trick " + std::to_string(game.trickNumber) + ". Waiting for the players to reconnect.");
+                    ChangeState("stateStartTrick", [this] { stateStartTrick(game.trickNumber); });
+                } else {
+                    Reporter::logWarning("The snapshot doesn't match the deals, starting a new game.");
+                }
+            }
         }
     }
 
 public:
     explicit Server(ServerConfig _config): config(std::move(_config)) {
         state = [this] { std::runtime_error("Server state is not set.");};
+        if (config.snapshotFilename) {
+            snapshot = std::make_unique<TableSnapshot>(*config.snapshotFilename);
+        }
+        observers.maxQueued = config.outputHighWatermark;
     }
 
     [[noreturn]] void run() {
-        poll.startAccepting(config.port.value_or(0));
+        if (config.traceFilename) {
+            Tracer::enable(*config.traceFilename);
+        }
+        install_signal_handler(SIGUSR1, [](int) { metricsDumpRequested = 1; }, SA_RESTART);
 
         // after successful poll, start the first trick in the first deal:
-        setCurrentDeal(config.deals.begin());
-        ChangeState([this] { stateStartTrick(Trick::FirstTrickNumber); });
+        setCurrentDeal(0);
+        ChangeState("stateStartTrick", [this] { stateStartTrick(Trick::FirstTrickNumber); });
+
+        // either take over the running server (with its sockets) or start from scratch (or from the snapshot)
+        if (!config.handoffPath || !_takeOver(*config.handoffPath)) {
+            poll.startAccepting(config.port.value_or(0));
+            if (config.localSocketPath) {
+                poll.startAcceptingLocal(*config.localSocketPath);
+            }
+            _restoreFromSnapshot();
+        }
+        if (config.handoffPath) {
+            poll.fds[poll.fdHandoffIdx] = {.fd = Handoff::listenForSuccessor(*config.handoffPath), .events = POLLIN, .revents = 0};
+        }
+        if (config.metricsPort) {
+            poll.startMetrics(*config.metricsPort);
+        }
+        if (config.maxParked > 0) {
+            poll.startParking(config.maxParked, config.maxParkedPerIP);
+        }
 
         while (true) {
             // after calling this function, fds are updated, all 4 players are present without any errors:
@@ -808,15 +3237,294 @@ public:
                 safePoll();
             stateShouldPoll = true;
 
+            if (_isTablePausedByBackpressure()) {
+                Reporter::debug(Color::Yellow, "Table paused until the slow players read their messages.");
+                continue;
+            }
+
             // call current state function
+            int64_t step_start_us = time_us();
             state();
+            metrics.step.record(time_us() - step_start_us);
+        }
+    }
+};
+
+// ------------------------- Benchmarks (--bench) -------------------------
+
+// Hardware counters of the calling thread (user space only) via perf_event_open, read together as one group.
+// They may be unavailable (no PMU in a VM, perf_event_paranoid, seccomp) - the benchmarks run without them then.
+class PerfCounters {
+public:
+    static constexpr int Count = 4;
+private:
+    std::array<int, Count> fds{-1, -1, -1, -1};
+    std::string error;
+
+    void _closeAll() {
+        for (auto& fd: fds) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+    }
+public:
+    PerfCounters() {
+        const std::array<uint64_t, Count> events = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < Count; ++i) {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof attr;
+            attr.config = events[i];
+            attr.disabled = i == 0; // the group is enabled through its leader
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC));
+            if (fds[i] < 0) {
+                error = strerror(errno);
+                _closeAll();
+                return;
+            }
+        }
+    }
+    ~PerfCounters() {
+        _closeAll();
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    [[nodiscard]] bool isAvailable() const { return fds[0] >= 0; }
+    [[nodiscard]] const std::string& unavailableReason() const { return error; }
+
+    void start() {
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    // cycles, instructions, cache misses, branch misses since start()
+    std::array<uint64_t, Count> stop() {
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        struct { uint64_t count; uint64_t values[Count]; } group{};
+        if (read(fds[0], &group, sizeof group) != sizeof group) {
+            syserr("read perf counters");
+        }
+        std::array<uint64_t, Count> values{};
+        std::copy(std::begin(group.values), std::end(group.values), values.begin());
+        return values;
+    }
+};
+
+// Microbenchmarks of the hot paths (`kierki-serwer --bench [max iterations]`), reported per operation: wall time,
+// heap allocations and (if available) cycles, instructions, cache and branch misses.
+class Benchmark {
+    PerfCounters perf;
+    uint64_t maxIterations;
+    static constexpr auto WarmUp = std::chrono::milliseconds(50); // the measured run then takes about 10 times longer
+
+    // keeps the compiler from optimizing the benchmarked work away
+    template<class T>
+    static void _keep(T&& value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    template<class Op>
+    void _run(const char* name, Op&& op) {
+        // the warm-up also calibrates the number of iterations, so that the slow operations don't take ages
+        uint64_t warmUpIterations = 0;
+        for (auto start = std::chrono::steady_clock::now(); std::chrono::steady_clock::now() - start < WarmUp && warmUpIterations < maxIterations; ) {
+            op();
+            warmUpIterations++;
+        }
+        uint64_t iterations = std::clamp<uint64_t>(warmUpIterations * 10, 1, maxIterations);
+
+        uint64_t allocations = AllocationCounter::count;
+        if (perf.isAvailable()) perf.start();
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) op();
+        auto elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::array<uint64_t, PerfCounters::Count> counters{};
+        if (perf.isAvailable()) counters = perf.stop();
+        allocations = AllocationCounter::count - allocations;
+
+        auto perOp = [iterations](double value) { return value / static_cast<double>(iterations); };
+        printf("%-26s %10.1f %8.2f", name, perOp(elapsed_ns), perOp(static_cast<double>(allocations)));
+        if (perf.isAvailable()) {
+            printf(" %10.1f %10.1f %6.2f %10.3f %10.3f", perOp(counters[0]), perOp(counters[1]),
+                   counters[0] ? static_cast<double>(counters[1]) / counters[0] : 0.0, perOp(counters[2]), perOp(counters[3]));
+        }
+        printf("\n");
+    }
+
+    // One deal played to the end by the robots, with the server's own steps of a trick (the robot's card, trickTaker,
+    // countPoints, PlayerStats::takeTrick and the serialized TAKEN), just without the sockets and the state machine.
+    static int _playDeal(const DealConfig& deal) {
+        std::array<PlayerStats, 4> stats;
+        for (int seat = 0; seat < 4; ++seat) {
+            stats[seat].takeNewDeal(deal.cardsOf(seatFromIndex(seat)), deal.dealType);
+        }
+        Seat leader = deal.firstSeat;
+        int checksum = 0;
+        std::vector<Card> cardsOnTable;
+        cardsOnTable.reserve(4);
+        for (int trickNumber = Trick::FirstTrickNumber; trickNumber <= Trick::LastTrickNumber; ++trickNumber) {
+            cardsOnTable.clear();
+            Seat seat = leader;
+            for (int i = 0; i < 4; ++i, seat = nextSeat(seat)) {
+                auto& player = stats[seatIndex(seat)];
+                Card card = player.chooseLegalCard(cardsOnTable);
+                cardsOnTable.push_back(card);
+                player.removeCard(card);
+            }
+            Seat taker = trickTaker(cardsOnTable, leader);
+            int points = countPoints(cardsOnTable, deal.dealType, trickNumber);
+            stats[seatIndex(taker)].takeTrick(cardsOnTable, points);
+            WireMessage takenMessage(Taken(trickNumber, cardsOnTable, taker));
+            checksum += static_cast<int>(takenMessage.text.size()) + points;
+            leader = taker;
+        }
+        return checksum;
+    }
+
+public:
+    explicit Benchmark(uint64_t maxIterations) : maxIterations(maxIterations) {}
+
+    int run() {
+        printf("%-26s %10s %8s", "benchmark (per op)", "ns", "allocs");
+        if (perf.isAvailable()) {
+            printf(" %10s %10s %6s %10s %10s", "cycles", "instr", "IPC", "cache-miss", "br-miss");
         }
+        printf("\n");
+
+        _run("Parser::parse TRICK", [] { _keep(Parser::parse("TRICK3QH10C\r\n")); });
+        _run("Parser::parse TAKEN", [] { _keep(Parser::parse("TAKEN3QH10C2C3CN\r\n")); });
+        _run("Parser::parse IAM", [] { _keep(Parser::parse("IAMN\r\n")); });
+
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) < 0) {
+            syserr("socketpair");
+        }
+        pollfd writerFd{.fd = sockets[0], .events = 0, .revents = 0}, readerFd{.fd = sockets[1], .events = 0, .revents = 0};
+        PollBuffer writer(&writerFd, false), reader(&readerFd, false);
+        const std::string trick = Trick(3, {Card("QH"), Card("10C")}).toString();
+        _run("PollBuffer write+read", [&] {
+            writer.writeMessage(trick);
+            readerFd.revents = POLLIN;
+            reader.update();
+            _keep(reader.readMessage());
+        });
+        writer.disconnect();
+        reader.disconnect();
+
+        const std::vector<Card> cards = {Card("QH"), Card("KH"), Card("JS"), Card("7C")};
+        int dealType = 0;
+        _run("countPoints", [&] {
+            _keep(countPoints(cards, static_cast<DealType>(dealType % 7 + 1), dealType % 13 + 1));
+            dealType++;
+        });
+
+        DealGenerator generator(1, DealGenerator::parseRotation("1234567"));
+        size_t dealIndex = 0;
+        _run("trick loop (13 tricks)", [&] { _keep(_playDeal(generator.generate(dealIndex++))); });
+
+        if (!perf.isAvailable()) {
+            printf("(hardware counters unavailable: perf_event_open: %s)\n", perf.unavailableReason().c_str());
+        }
+        return 0;
+    }
+
+    // Memory of the parked connections (`kierki-serwer --bench-idle [connections]`): both ends of local socket pairs
+    // are parked, then some of them send a partial IAM and finally get unparked. The resident bytes are the whole
+    // process (the kernel's socket and epoll memory is not included), the heap bytes are the allocated ones.
+    static int runIdle(size_t connections) {
+        connections += connections % 2;
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < connections + 64) {
+            limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, connections + 64);
+            setrlimit(RLIMIT_NOFILE, &limit);
+            connections = std::min<size_t>(connections, (limit.rlim_cur - 64) & ~size_t{1});
+        }
+        auto residentBytes = [] {
+            long pages = 0, resident = 0;
+            if (FILE* statm = fopen("/proc/self/statm", "r")) {
+                if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+                fclose(statm);
+            }
+            return static_cast<double>(resident) * static_cast<double>(sysconf(_SC_PAGESIZE));
+        };
+        auto report = [connections](const char* phase, double resident, double heap) {
+            printf("%-36s %12.1f %14.1f\n", phase, resident / static_cast<double>(connections), heap / static_cast<double>(connections));
+        };
+
+        printf("%zu parked connections (record: %zu bytes)\n", connections, IdleConnections::recordBytes());
+        printf("%-36s %12s %14s\n", "phase (per connection)", "resident B", "heap alloc B");
+        double resident = residentBytes();
+        uint64_t heap = AllocationCounter::bytes;
+        IdleConnections idle(connections, connections); // (all of them are local)
+        std::vector<int> fds;
+        fds.reserve(connections);
+        for (size_t i = 0; i < connections; i += 2) {
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sockets) < 0) {
+                syserr("socketpair (%zu connections so far)", i);
+            }
+            for (int fd: sockets) {
+                if (!idle.park(fd, in6addr_loopback)) {
+                    fatal("cannot park connection %zu", i);
+                }
+                fds.push_back(fd);
+            }
+        }
+        idle.update();
+        report("parked, idle", residentBytes() - resident, static_cast<double>(AllocationCounter::bytes - heap));
+
+        // every 10th connection gets a partial IAM from its peer (so it stays parked, with its input)
+        size_t senders = 0;
+        for (size_t i = 0; i < fds.size(); i += 20) {
+            if (send(fds[i + 1], "IAM", 3, MSG_NOSIGNAL) == 3) senders++;
+        }
+        for (size_t i = 0; i <= senders / 256 + 1; ++i) {
+            idle.update(); // (a batch of the ready ones at a time)
+        }
+        report("parked, 10% with input", residentBytes() - resident, static_cast<double>(AllocationCounter::bytes - heap));
+
+        size_t unparked = 0;
+        while (auto ready = idle.takeReady()) {
+            unparked++;
+            _keep(ready->input);
+        }
+        report("unparked the ones with input", residentBytes() - resident, static_cast<double>(AllocationCounter::bytes - heap));
+        printf("(%zu of %zu senders unparked; the heap column counts the allocated bytes, not the freed ones)\n", unparked, senders);
+        return 0;
     }
 };
 
 int main(int argc, char** argv) {
     install_sigpipe_handler();
 
+    if (argc == 4 && std::string(argv[1]) == "--compile-deals") {
+        return DealPack::compile(argv[2], argv[3]);
+    }
+    if (argc == 3 && std::string(argv[1]) == "--check-deals") {
+        return DealPack::isPack(MappedFile(argv[2])) ? DealSource::checkPack(argv[2]) : DealFileParser::check(argv[2]);
+    }
+    // the optional count of the benchmarks (a positive number)
+    auto benchCount = [argc, argv](uint64_t fallback) -> uint64_t {
+        if (argc < 3) return fallback;
+        std::string arg = argv[2];
+        if (arg.empty() || !std::all_of(arg.begin(), arg.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }) ||
+            arg.size() > 18 || std::stoull(arg) == 0) {
+            Reporter::error("Argument error: " + arg + " is not a positive number");
+            exit(1);
+        }
+        return std::stoull(arg);
+    };
+    if (argc >= 2 && argc <= 3 && std::string(argv[1]) == "--bench") {
+        return Benchmark(benchCount(1000000)).run();
+    }
+    if (argc >= 2 && argc <= 3 && std::string(argv[1]) == "--bench-idle") {
+        return Benchmark::runIdle(benchCount(100000));
+    }
+
     ServerConfig config = ServerConfig::FromArgs(argc, argv);
     Server server(config);
     server.run();